@@ -0,0 +1,257 @@
+/*
+ *  bench_forward.c
+ *  Author:
+ *
+ *  Lookup and update benchmark of the ip_forward engines. Every engine
+ *  and table size runs in a child process of its own, so that the
+ *  peak RSS it reports belongs to that configuration alone.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "ip_forward.h"
+#include "output.h"
+#include "workload.h"
+
+/* Number of hot destinations of the Zipf-skewed lookups. */
+#define BENCH_HOT 65536
+
+typedef struct bench_config {
+  uint64_t seed;
+  size_t prefixes;
+  size_t lookups;
+  size_t updates;
+  forward_engine engine;
+  uint32_t cache_entries;
+  int simd;
+  int aggregate;
+} bench_config;
+
+static const char *engine_names[] = { "radix", "dir24-8", "tree-bitmap", "interval" };
+#define NUM_ENGINES (sizeof(engine_names) / sizeof(engine_names[0]))
+
+/* Forwards all packets in batches, recording the ns per packet of
+ * every batch. Returns the total in ns.
+ */
+static uint64_t bench_lookups(router_state state, const uint32_t *ips, const unsigned *ids,
+                              size_t n, double *samples) {
+  uint64_t start, t, total = 0;
+  size_t i, m;
+
+  for (i = 0; i < n; i += m) {
+    m = min(n - i, (size_t) FORWARD_BATCH);
+    start = workload_now_ns();
+    forward_packet_batch(state, ips + i, ids + i, m);
+    t = workload_now_ns() - start;
+    samples[i / FORWARD_BATCH] = (double) t / m;
+    total += t;
+  }
+  return total;
+}
+
+static void report_lookups(const char *name, uint64_t ns, size_t n, double *samples) {
+  size_t batches = (n + FORWARD_BATCH - 1) / FORWARD_BATCH;
+
+  workload_sort(samples, batches);
+  printf("  %-8s %8.2f Mlookups/s   ns/op p50 %6.1f  p90 %6.1f  p99 %6.1f\n", name,
+         n * 1e3 / ns, workload_percentile(samples, batches, 50),
+         workload_percentile(samples, batches, 90), workload_percentile(samples, batches, 99));
+}
+
+static void bench_run(const bench_config *config) {
+  workload_rng rng;
+  workload_prefix *prefixes;
+  workload_zipf zipf;
+  radix_prefix *entries;
+  router_state state;
+  uint32_t *ips, *hot;
+  unsigned *ids;
+  double *samples;
+  uint64_t start, ns, budget;
+  size_t i, n, batches;
+  int nic;
+
+  n = config->prefixes;
+  prefixes = (workload_prefix*) malloc(n * sizeof(workload_prefix));
+  entries = (radix_prefix*) malloc(n * sizeof(radix_prefix));
+  ips = (uint32_t*) malloc(config->lookups * sizeof(uint32_t));
+  ids = (unsigned*) malloc(config->lookups * sizeof(unsigned));
+  hot = (uint32_t*) malloc(BENCH_HOT * sizeof(uint32_t));
+  batches = (config->lookups + FORWARD_BATCH - 1) / FORWARD_BATCH;
+  samples = (double*) malloc((batches > config->updates ? batches : config->updates) * sizeof(double));
+  if (!prefixes || !entries || !ips || !ids || !hot || !samples) {
+    perror("Could not allocate workload");
+    exit(EXIT_FAILURE);
+  }
+
+  workload_seed(&rng, config->seed);
+  workload_prefixes(&rng, LENGTHS_BGP, prefixes, n);
+  for (i = 0; i < n; i++) {
+    entries[i].key = prefixes[i].ip;
+    entries[i].bits = prefixes[i].netsize;
+    entries[i].value = workload_below(&rng, NUM_NICS);
+  }
+  for (i = 0; i < config->lookups; i++)
+    ids[i] = i;
+
+  printf("%s%s%s%s, %zu prefixes\n", engine_names[config->engine],
+         config->simd ? "" : " (scalar)", config->aggregate ? " + aggregation" : "",
+         config->cache_entries ? " + flow cache" : "", n);
+  fflush(stdout);
+
+  // Table output goes nowhere
+  output_init(&out_stdout, open("/dev/null", O_WRONLY));
+
+  state = initialize_router();
+  set_forwarding_engine(state, config->engine);
+  set_simd(state, config->simd);
+  if (config->aggregate && set_aggregation(state, 1)) {
+    perror("Could not set up aggregation");
+    exit(EXIT_FAILURE);
+  }
+  if (config->cache_entries && set_flow_cache(state, config->cache_entries)) {
+    perror("Could not allocate the flow cache");
+    exit(EXIT_FAILURE);
+  }
+  start = workload_now_ns();
+  load_forwarding_table(&state, entries, n);
+  ns = workload_now_ns() - start;
+  printf("  load     %8.1f ms", ns / 1e6);
+  start = workload_now_ns();
+  forward_packet(state, 0, 0);
+  printf("   first lookup (compile) %8.1f ms\n", (workload_now_ns() - start) / 1e6);
+
+  for (i = 0; i < config->lookups; i++)
+    ips[i] = workload_destination(&rng, prefixes, n);
+  ns = bench_lookups(state, ips, ids, config->lookups, samples);
+  report_lookups("uniform", ns, config->lookups, samples);
+
+  if (workload_zipf_init(&zipf, BENCH_HOT, 1.0)) {
+    perror("Could not allocate destinations");
+    exit(EXIT_FAILURE);
+  }
+  for (i = 0; i < BENCH_HOT; i++)
+    hot[i] = workload_destination(&rng, prefixes, n);
+  for (i = 0; i < config->lookups; i++)
+    ips[i] = hot[workload_zipf_next(&zipf, &rng)];
+  workload_zipf_free(&zipf);
+  ns = bench_lookups(state, ips, ids, config->lookups, samples);
+  report_lookups("zipf", ns, config->lookups, samples);
+
+  /* Churn: a new NIC or a deletion for a random prefix. An update is
+   * timed until a lookup sees it, which includes any recompilation;
+   * the phase stops after two seconds.
+   */
+  budget = workload_now_ns() + 2000000000ULL;
+  ns = 0;
+  for (i = 0; i < config->updates && workload_now_ns() < budget; i++) {
+    const workload_prefix *prefix = &prefixes[workload_below(&rng, n)];
+    nic = workload_below(&rng, 2) ? (int) workload_below(&rng, NUM_NICS) : -1;
+    start = workload_now_ns();
+    populate_forwarding_table(&state, prefix->ip, prefix->netsize, nic);
+    forward_packet(state, prefix->ip, 0);
+    samples[i] = workload_now_ns() - start;
+    ns += samples[i];
+  }
+  workload_sort(samples, i);
+  printf("  churn    %8.0f updates/s   us/op p50 %6.2f  p90 %6.2f  p99 %6.2f  (%zu updates)\n",
+         i * 1e9 / ns, workload_percentile(samples, i, 50) / 1e3,
+         workload_percentile(samples, i, 90) / 1e3, workload_percentile(samples, i, 99) / 1e3, i);
+
+  print_flow_cache_stats(state, stdout);
+  printf("  peak RSS %8.1f MB\n\n", workload_peak_rss_kb() / 1024.0);
+  fflush(stdout);
+  destroy_router(state);
+  free(prefixes);
+  free(entries);
+  free(ips);
+  free(ids);
+  free(hot);
+  free(samples);
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [-s seed] [-n lookups] [-u updates] [-e radix|dir24-8|tree-bitmap|interval]\n"
+                  "       [-c flow_cache_entries] [-S] [-a] [prefixes...]\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+  static const size_t default_sizes[] = { 1000, 10000, 100000, 1000000 };
+  bench_config config;
+  int engines[NUM_ENGINES] = { 1, 1, 1, 1 };
+  int opt, found;
+  unsigned e;
+  size_t i, num_sizes;
+  pid_t pid;
+
+  config.seed = 1;
+  config.lookups = 1000000;
+  config.updates = 100000;
+  config.cache_entries = 0;
+  config.simd = 1;
+  config.aggregate = 0;
+  while ((opt = getopt(argc, argv, "s:n:u:e:c:Sa")) != -1) {
+    switch (opt) {
+    case 's':
+      config.seed = strtoull(optarg, NULL, 10);
+      break;
+    case 'n':
+      config.lookups = strtoul(optarg, NULL, 10);
+      break;
+    case 'u':
+      config.updates = strtoul(optarg, NULL, 10);
+      break;
+    case 'e':
+      for (e = 0, found = 0; e < NUM_ENGINES; e++)
+        found |= engines[e] = !strcmp(optarg, engine_names[e]);
+      if (!found) {
+        usage(argv[0]);
+        return 2;
+      }
+      break;
+    case 'c':
+      config.cache_entries = strtoul(optarg, NULL, 10);
+      break;
+    case 'S':
+      config.simd = 0;
+      break;
+    case 'a':
+      config.aggregate = 1;
+      break;
+    default:
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if (!config.lookups) {
+    usage(argv[0]);
+    return 2;
+  }
+  num_sizes = (optind < argc) ? (size_t) (argc - optind) : sizeof(default_sizes) / sizeof(size_t);
+
+  for (e = 0; e < NUM_ENGINES; e++) {
+    if (!engines[e]) continue;
+    for (i = 0; i < num_sizes; i++) {
+      config.engine = (forward_engine) e;
+      config.prefixes = (optind < argc) ? strtoul(argv[optind + i], NULL, 10) : default_sizes[i];
+      if (!config.prefixes) continue;
+      fflush(stdout);
+      pid = fork();
+      if (pid == 0) {
+        bench_run(&config);
+        exit(EXIT_SUCCESS);
+      }
+      if (pid < 0 || waitpid(pid, NULL, 0) < 0) {
+        perror("Could not run benchmark");
+        return EXIT_FAILURE;
+      }
+    }
+  }
+  return EXIT_SUCCESS;
+}
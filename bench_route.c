@@ -0,0 +1,162 @@
+/*
+ *  bench_route.c
+ *  Author:
+ *
+ *  Update benchmark of ip_route. Like bench_forward, every table size
+ *  runs in a child process of its own.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "ip_route.h"
+#include "output.h"
+#include "workload.h"
+
+typedef struct bench_config {
+  uint64_t seed;
+  size_t prefixes;
+  size_t updates;
+  double zipf_s;
+  int num_nics;
+} bench_config;
+
+static void report_updates(const char *name, uint64_t ns, size_t n, double *samples) {
+  workload_sort(samples, n);
+  printf("  %-8s %8.0f updates/s   ns/op p50 %7.0f  p90 %7.0f  p99 %7.0f\n", name,
+         n * 1e9 / ns, workload_percentile(samples, n, 50),
+         workload_percentile(samples, n, 90), workload_percentile(samples, n, 99));
+}
+
+static void bench_run(const bench_config *config) {
+  workload_rng rng;
+  workload_prefix *prefixes;
+  workload_zipf zipf;
+  router_state state;
+  double *samples;
+  uint64_t start, ns;
+  size_t i, n;
+  unsigned int metric;
+  int nic;
+
+  n = config->prefixes;
+  prefixes = (workload_prefix*) malloc(n * sizeof(workload_prefix));
+  samples = (double*) malloc((n > config->updates ? n : config->updates) * sizeof(double));
+  if (!prefixes || !samples) {
+    perror("Could not allocate workload");
+    exit(EXIT_FAILURE);
+  }
+  workload_seed(&rng, config->seed);
+  workload_prefixes(&rng, LENGTHS_BGP, prefixes, n);
+
+  printf("ip_route, %zu prefixes, %d NICs\n", n, config->num_nics);
+  fflush(stdout);
+
+  // Advertisements go nowhere
+  output_init(&out_stdout, open("/dev/null", O_WRONLY));
+
+  // Every prefix is first announced by a random NIC
+  state = initialize_router();
+  set_num_nics(state, config->num_nics);
+  ns = 0;
+  for (i = 0; i < n; i++) {
+    nic = workload_below(&rng, config->num_nics);
+    metric = workload_below(&rng, 30) + 1;
+    start = workload_now_ns();
+    process_update(&state, prefixes[i].ip, prefixes[i].netsize, nic, metric, i);
+    samples[i] = workload_now_ns() - start;
+    ns += samples[i];
+  }
+  report_updates("announce", ns, n, samples);
+
+  /* Churn: distance vectors from random NICs for prefixes drawn with
+   * Zipf-skewed popularity (or uniformly), unreachable one time in ten.
+   */
+  if (config->zipf_s > 0 && workload_zipf_init(&zipf, n, config->zipf_s)) {
+    perror("Could not allocate destinations");
+    exit(EXIT_FAILURE);
+  }
+  ns = 0;
+  for (i = 0; i < config->updates; i++) {
+    const workload_prefix *prefix = &prefixes[(config->zipf_s > 0) ?
+        workload_zipf_next(&zipf, &rng) : workload_below(&rng, n)];
+    nic = workload_below(&rng, config->num_nics);
+    metric = workload_below(&rng, 10) ? workload_below(&rng, 30) + 1 : METRIC_UNREACHABLE;
+    start = workload_now_ns();
+    process_update(&state, prefix->ip, prefix->netsize, nic, metric, n + i);
+    samples[i] = workload_now_ns() - start;
+    ns += samples[i];
+  }
+  report_updates("churn", ns, config->updates, samples);
+  if (config->zipf_s > 0)
+    workload_zipf_free(&zipf);
+
+  output_flush(&out_stdout);
+  printf("  peak RSS %8.1f MB\n\n", workload_peak_rss_kb() / 1024.0);
+  fflush(stdout);
+  destroy_router(state);
+  free(prefixes);
+  free(samples);
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [-s seed] [-u updates] [-z zipf_exponent] [-n nics] [prefixes...]\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+  static const size_t default_sizes[] = { 1000, 10000, 100000, 1000000 };
+  bench_config config;
+  int opt;
+  size_t i, num_sizes;
+  pid_t pid;
+
+  config.seed = 1;
+  config.updates = 1000000;
+  config.zipf_s = 0;
+  config.num_nics = NUM_NICS;
+  while ((opt = getopt(argc, argv, "s:u:z:n:")) != -1) {
+    switch (opt) {
+    case 's':
+      config.seed = strtoull(optarg, NULL, 10);
+      break;
+    case 'u':
+      config.updates = strtoul(optarg, NULL, 10);
+      break;
+    case 'z':
+      config.zipf_s = strtod(optarg, NULL);
+      break;
+    case 'n':
+      config.num_nics = atoi(optarg);
+      if (config.num_nics < 1 || config.num_nics > MAX_NICS) {
+        usage(argv[0]);
+        return 2;
+      }
+      break;
+    default:
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  num_sizes = (optind < argc) ? (size_t) (argc - optind) : sizeof(default_sizes) / sizeof(size_t);
+
+  for (i = 0; i < num_sizes; i++) {
+    config.prefixes = (optind < argc) ? strtoul(argv[optind + i], NULL, 10) : default_sizes[i];
+    if (!config.prefixes) continue;
+    fflush(stdout);
+    pid = fork();
+    if (pid == 0) {
+      bench_run(&config);
+      exit(EXIT_SUCCESS);
+    }
+    if (pid < 0 || waitpid(pid, NULL, 0) < 0) {
+      perror("Could not run benchmark");
+      return EXIT_FAILURE;
+    }
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,237 @@
+/*
+ * dir24_8.c
+ * Author:
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <immintrin.h>
+
+#include "dir24_8.h"
+
+// Turn the /24 slot into a chunk (if it isn't one already) and return it
+static uint32_t* dir24_8_chunk(dir24_8 *dir, uint32_t slot) {
+  uint32_t entry, index, *tbl8;
+  int i;
+
+  entry = dir->tbl24[slot];
+  if (entry & DIR24_CHUNK_FLAG)
+    return dir->tbl8 + ((entry & ~DIR24_CHUNK_FLAG) << 8);
+
+  if (dir->free_chunk != DIR24_NO_CHUNK) {
+    index = dir->free_chunk;
+    dir->free_chunk = dir->tbl8[(size_t) index << 8];
+    dir->num_free--;
+  } else {
+    if (dir->num_chunks == dir->max_chunks) {
+      dir->max_chunks = dir->max_chunks ? dir->max_chunks * 2 : 64;
+      tbl8 = (uint32_t*) realloc(dir->tbl8, (size_t) dir->max_chunks * DIR24_CHUNK_SIZE * sizeof(uint32_t));
+      if (!tbl8) return NULL;
+      dir->tbl8 = tbl8;
+    }
+    index = dir->num_chunks++;
+  }
+  tbl8 = dir->tbl8 + ((size_t) index << 8);
+  for (i = 0; i < DIR24_CHUNK_SIZE; i++)
+    tbl8[i] = entry;
+  dir->tbl24[slot] = DIR24_CHUNK_FLAG | index;
+  return tbl8;
+}
+
+// Put entry in the /24 slot, freeing the chunk it may have had
+static void dir24_8_set(dir24_8 *dir, uint32_t slot, uint32_t entry) {
+  uint32_t index;
+
+  if (dir->tbl24[slot] & DIR24_CHUNK_FLAG) {
+    index = dir->tbl24[slot] & ~DIR24_CHUNK_FLAG;
+    dir->tbl8[(size_t) index << 8] = dir->free_chunk;
+    dir->free_chunk = index;
+    dir->num_free++;
+  }
+  dir->tbl24[slot] = entry;
+}
+
+// Turn the chunk of the /24 slot back into a plain entry if all of its entries are the same
+static void dir24_8_collapse(dir24_8 *dir, uint32_t slot) {
+  uint32_t *chunk;
+  int i;
+
+  if (!(dir->tbl24[slot] & DIR24_CHUNK_FLAG)) return;
+  chunk = dir->tbl8 + ((dir->tbl24[slot] & ~DIR24_CHUNK_FLAG) << 8);
+  for (i = 1; i < DIR24_CHUNK_SIZE; i++) {
+    if (chunk[i] != chunk[0]) return;
+  }
+  dir24_8_set(dir, slot, chunk[0]);
+}
+
+/* Paints every prefix of the tree over the tables. The walk is
+ * preorder, so a prefix always overwrites the ones that contain it.
+ */
+static int dir24_8_fill(dir24_8 *dir, radix_pool *pool, uint32_t tree,
+    uint8_t prefix_bits, uint32_t prefix) {
+  uint32_t key, entry, first, count, *chunk;
+  uint8_t bits;
+  radix_node *node;
+
+  if (tree == RADIX_NIL) return 0;
+  node = RADIX_NODE(pool, tree);
+  // a netsize past 32 is a host route, as the radix lookups take it
+  bits = min(prefix_bits + node->bits, 32);
+  key = prefix + (node->key >> prefix_bits);
+
+  if (node->has_value) {
+    // nic + 1 must not collide with the chunk flag; -1 (no route) is 0
+    if (node->value < -1 || (int64_t) node->value >= DIR24_CHUNK_FLAG - 1)
+      return -1;
+    entry = (uint32_t) node->value + 1;
+    first = key & PREFIX_MASK(bits);
+
+    if (bits <= 24) {
+      count = 1U << (24 - bits);
+      first >>= 8;
+      while (count--)
+        dir->tbl24[first++] = entry;
+    } else {
+      chunk = dir24_8_chunk(dir, first >> 8);
+      if (!chunk) return -1;
+      count = 1U << (32 - bits);
+      first &= 0xFF;
+      while (count--)
+        chunk[first++] = entry;
+    }
+  }
+
+  // the children only take the prefix, not host bits past it
+  key &= PREFIX_MASK(bits);
+  if (dir24_8_fill(dir, pool, node->left, bits, key) ||
+      dir24_8_fill(dir, pool, node->right, bits, key))
+    return -1;
+  return 0;
+}
+
+/* Compiles the radix tree into a DIR-24-8 table. The tables of dir
+ * are reused if it is not NULL. Returns NULL (and frees dir) if the
+ * tree holds a NIC that cannot be encoded or memory runs out; the
+ * caller should keep using the radix tree in that case.
+ */
+dir24_8* dir24_8_build(dir24_8 *dir, radix_pool *pool, uint32_t tree) {
+  if (!dir) {
+    dir = (dir24_8*) calloc(1, sizeof(dir24_8));
+    if (!dir) return NULL;
+    dir->tbl24 = (uint32_t*) calloc(DIR24_TBL24_SIZE, sizeof(uint32_t));
+    if (!dir->tbl24) {
+      free(dir);
+      return NULL;
+    }
+  } else {
+    memset(dir->tbl24, 0, DIR24_TBL24_SIZE * sizeof(uint32_t));
+  }
+  dir->num_chunks = 0;
+  dir->free_chunk = DIR24_NO_CHUNK;
+  dir->num_free = 0;
+
+  if (dir24_8_fill(dir, pool, tree, 0, 0)) {
+    dir24_8_free(dir);
+    return NULL;
+  }
+  return dir;
+}
+
+/* Brings the tables up to date after the radix tree changed at
+ * ip/netsize, repainting only the addresses under that prefix: first
+ * with the longest prefix around them, then with the prefixes of the
+ * subtree under it. Returns -1 if the tree holds a NIC that cannot be
+ * encoded or memory runs out, leaving the tables half patched; they
+ * must be rebuilt then.
+ */
+int dir24_8_patch(dir24_8 *dir, radix_pool *pool, uint32_t tree, uint32_t ip, uint8_t netsize) {
+  uint32_t prefix, entry, first, count, *chunk;
+  uint8_t prefix_bits;
+  int nic = -1;
+
+  netsize = min(netsize, 32);
+  ip &= PREFIX_MASK(netsize);
+  tree = radix_subtree(pool, tree, netsize, ip, &prefix_bits, &prefix, &nic);
+  if (nic < -1 || (int64_t) nic >= DIR24_CHUNK_FLAG - 1)
+    return -1;
+  entry = (uint32_t) nic + 1;
+
+  if (netsize <= 24) {
+    first = ip >> 8;
+    for (count = 1U << (24 - netsize); count--; first++)
+      dir24_8_set(dir, first, entry);
+  } else {
+    chunk = dir24_8_chunk(dir, ip >> 8);
+    if (!chunk) return -1;
+    first = ip & 0xFF;
+    for (count = 1U << (32 - netsize); count--; first++)
+      chunk[first] = entry;
+  }
+  if (dir24_8_fill(dir, pool, tree, prefix_bits, prefix))
+    return -1;
+  if (netsize > 24)
+    dir24_8_collapse(dir, ip >> 8);
+  return 0;
+}
+
+/* Looks up n (at most FORWARD_BATCH) addresses, prefetching all first level entries before
+ * reading any, then all second level entries.
+ */
+void dir24_8_lookup_batch(const dir24_8 *dir, const uint32_t *ips, int *nics, int n) {
+  uint32_t entry[FORWARD_BATCH];
+  int i;
+
+  for (i = 0; i < n; i++)
+    __builtin_prefetch(&dir->tbl24[ips[i] >> 8]);
+  for (i = 0; i < n; i++) {
+    entry[i] = dir->tbl24[ips[i] >> 8];
+    if (entry[i] & DIR24_CHUNK_FLAG) {
+      entry[i] = ((entry[i] & ~DIR24_CHUNK_FLAG) << 8) | (ips[i] & 0xFF);
+      __builtin_prefetch(&dir->tbl8[entry[i]]);
+      nics[i] = -2;
+    } else {
+      nics[i] = (int) entry[i] - 1;
+    }
+  }
+  for (i = 0; i < n; i++) {
+    if (nics[i] == -2)
+      nics[i] = (int) dir->tbl8[entry[i]] - 1;
+  }
+}
+
+/* AVX2 version of dir24_8_lookup_batch, eight addresses to a vector.
+ * The first level entries of the whole batch are gathered before any
+ * of the second level ones, which only the lanes whose entry has
+ * DIR24_CHUNK_FLAG (the sign bit, which masks the gather) read. Only
+ * call it if the CPU has AVX2.
+ */
+__attribute__((target("avx2")))
+void dir24_8_lookup_batch_avx2(const dir24_8 *dir, const uint32_t *ips, int *nics, int n) {
+  const __m256i flag = _mm256_set1_epi32(DIR24_CHUNK_FLAG);
+  const __m256i low = _mm256_set1_epi32(0xFF);
+  const __m256i one = _mm256_set1_epi32(1);
+  __m256i ip[FORWARD_BATCH / 8], entry[FORWARD_BATCH / 8], index;
+  int i, v;
+
+  v = n / 8;
+  for (i = 0; i < v; i++) {
+    ip[i] = _mm256_loadu_si256((const __m256i*) (ips + 8 * i));
+    entry[i] = _mm256_i32gather_epi32((const int*) dir->tbl24, _mm256_srli_epi32(ip[i], 8), 4);
+  }
+  for (i = 0; i < v; i++) {
+    index = _mm256_or_si256(_mm256_slli_epi32(_mm256_andnot_si256(flag, entry[i]), 8),
+                            _mm256_and_si256(ip[i], low));
+    entry[i] = _mm256_mask_i32gather_epi32(entry[i], (const int*) dir->tbl8, index, entry[i], 4);
+    _mm256_storeu_si256((__m256i*) (nics + 8 * i), _mm256_sub_epi32(entry[i], one));
+  }
+  if (n > 8 * v)
+    dir24_8_lookup_batch(dir, ips + 8 * v, nics + 8 * v, n - 8 * v);
+}
+
+void dir24_8_free(dir24_8 *dir) {
+  if (!dir) return;
+  free(dir->tbl24);
+  free(dir->tbl8);
+  free(dir);
+}
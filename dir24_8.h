@@ -0,0 +1,52 @@
+/*
+ *  dir24_8.h
+ *  Author:
+ */
+
+#ifndef _DIR24_8_H_
+#define _DIR24_8_H_
+
+#include <stdint.h>
+
+#include "ip_forward.h"
+
+/* First level: one entry per /24, indexed by the 24 leading bits of
+ * the address. Second level: 256-entry chunks for /24s that contain
+ * longer prefixes. An entry holds nic + 1 (0 meaning no route), or
+ * DIR24_CHUNK_FLAG plus the index of a chunk.
+ */
+#define DIR24_TBL24_SIZE (1U << 24)
+#define DIR24_CHUNK_SIZE 256
+#define DIR24_CHUNK_FLAG 0x80000000U
+#define DIR24_NO_CHUNK 0xFFFFFFFFU
+
+/* Most tbl24 slots dir24_8_patch may repaint between two lookups
+ * before the router gives up patching and rebuilds instead.
+ */
+#define DIR24_PATCH_BUDGET (1U << 20)
+
+typedef struct dir24_8 {
+  uint32_t *tbl24;
+  uint32_t *tbl8;
+  uint32_t num_chunks, max_chunks;
+  uint32_t free_chunk;   // chunks freed by patches, chained through their first entry
+  uint32_t num_free;
+} dir24_8;
+
+dir24_8* dir24_8_build(dir24_8 *dir, radix_pool *pool, uint32_t tree);
+int dir24_8_patch(dir24_8 *dir, radix_pool *pool, uint32_t tree, uint32_t ip, uint8_t netsize);
+void dir24_8_free(dir24_8 *dir);
+void dir24_8_lookup_batch(const dir24_8 *dir, const uint32_t *ips, int *nics, int n);
+void dir24_8_lookup_batch_avx2(const dir24_8 *dir, const uint32_t *ips, int *nics, int n);
+
+/* Returns the NIC of the longest prefix containing ip, or -1. */
+static inline int dir24_8_lookup(const dir24_8 *dir, uint32_t ip) {
+  uint32_t entry;
+
+  entry = dir->tbl24[ip >> 8];
+  if (entry & DIR24_CHUNK_FLAG)
+    entry = dir->tbl8[((entry & ~DIR24_CHUNK_FLAG) << 8) | (ip & 0xFF)];
+  return (int) entry - 1;
+}
+
+#endif
@@ -0,0 +1,49 @@
+/*
+ * flow_cache.c
+ * Author:
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "flow_cache.h"
+
+/* Creates a cache of at least the given number of entries (rounded up
+ * to a power of two sets). Returns NULL if out of memory.
+ */
+flow_cache* flow_cache_create(uint32_t entries) {
+  flow_cache *cache;
+  uint32_t set_bits = 1;
+
+  while (set_bits < 24 && ((uint32_t) FLOW_CACHE_WAYS << set_bits) < entries)
+    set_bits++;
+
+  cache = (flow_cache*) malloc(sizeof(flow_cache));
+  if (!cache) return NULL;
+  cache->sets = (flow_cache_set*) calloc((size_t) 1 << set_bits, sizeof(flow_cache_set));
+  if (!cache->sets) {
+    free(cache);
+    return NULL;
+  }
+  cache->set_bits = set_bits;
+  cache->generation = 1;
+  cache->hits = cache->misses = 0;
+  return cache;
+}
+
+/* Drops every entry. Only on wraparound of the generation counter does
+ * this have to touch the sets.
+ */
+void flow_cache_invalidate(flow_cache *cache) {
+  if (++cache->generation == 0) {
+    memset(cache->sets, 0, sizeof(flow_cache_set) << cache->set_bits);
+    cache->generation = 1;
+  }
+}
+
+void flow_cache_free(flow_cache *cache) {
+  if (!cache) return;
+  free(cache->sets);
+  free(cache);
+}
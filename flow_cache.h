@@ -0,0 +1,90 @@
+/*
+ *  flow_cache.h
+ *  Author:
+ */
+
+#ifndef _FLOW_CACHE_H_
+#define _FLOW_CACHE_H_
+
+#include <stdint.h>
+
+/* Destination -> NIC cache in front of the lookup engines. It is
+ * 4-way set associative; a set is one 64-byte line, its ways in order
+ * of use, most recent first, so that a miss replaces the least
+ * recently used entry. Entries are tagged with the generation of the
+ * table they were looked up in, so a table change invalidates the
+ * whole cache by bumping the generation.
+ */
+#define FLOW_CACHE_WAYS 4
+
+typedef struct flow_cache_set {
+  uint32_t ip[FLOW_CACHE_WAYS];
+  int32_t nic[FLOW_CACHE_WAYS];
+  uint32_t generation[FLOW_CACHE_WAYS];
+  uint32_t pad[FLOW_CACHE_WAYS];
+} flow_cache_set;
+
+typedef struct flow_cache {
+  flow_cache_set *sets;
+  uint32_t set_bits;
+  uint32_t generation;   // 0 never matches, so new sets start out empty
+  uint64_t hits, misses;
+} flow_cache;
+
+flow_cache* flow_cache_create(uint32_t entries);
+void flow_cache_invalidate(flow_cache *cache);
+void flow_cache_free(flow_cache *cache);
+
+static inline flow_cache_set* flow_cache_set_of(const flow_cache *cache, uint32_t ip) {
+  return &cache->sets[(ip * 2654435761U) >> (32 - cache->set_bits)];
+}
+
+// Store an entry in the first way, moving the ways before way back by one
+static inline void flow_cache_promote(flow_cache_set *set, int way, uint32_t ip, int nic,
+                                      uint32_t generation) {
+  for (; way > 0; way--) {
+    set->ip[way] = set->ip[way - 1];
+    set->nic[way] = set->nic[way - 1];
+    set->generation[way] = set->generation[way - 1];
+  }
+  set->ip[0] = ip;
+  set->nic[0] = nic;
+  set->generation[0] = generation;
+}
+
+/* Looks ip up, returning 1 and setting *nic on a hit. A hit makes the
+ * entry the most recent of its set.
+ */
+static inline int flow_cache_lookup(flow_cache *cache, uint32_t ip, int *nic) {
+  flow_cache_set *set = flow_cache_set_of(cache, ip);
+  int way;
+
+  for (way = 0; way < FLOW_CACHE_WAYS; way++) {
+    if (set->ip[way] == ip && set->generation[way] == cache->generation) {
+      *nic = set->nic[way];
+      if (way)
+        flow_cache_promote(set, way, ip, *nic, cache->generation);
+      cache->hits++;
+      return 1;
+    }
+  }
+  cache->misses++;
+  return 0;
+}
+
+/* Adds ip as the most recent entry of its set. If ip is already there
+ * (a batch can miss on it twice) that entry is reused, otherwise the
+ * least recently used one is evicted.
+ */
+static inline void flow_cache_insert(flow_cache *cache, uint32_t ip, int nic) {
+  flow_cache_set *set = flow_cache_set_of(cache, ip);
+  int way;
+
+  for (way = 0; way < FLOW_CACHE_WAYS - 1; way++) {
+    if (set->ip[way] == ip && set->generation[way] == cache->generation)
+      break;
+  }
+  flow_cache_promote(set, way, ip, nic, cache->generation);
+}
+
+#endif
@@ -1,16 +1,141 @@
+/*
+ *  gen_cidr.c
+ *  Author:
+ *
+ *  Generates a repeatable trace: a table of random prefixes, followed
+ *  by packets and, optionally, table updates mixed in with them.
+ */
+
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "workload.h"
+#include "capacity.h"
+
+/* Number of hot destinations of a Zipf-skewed trace. */
+#define ZIPF_HOT 65536
+
+static void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [-s seed] [-l uniform|bgp] [-p packets] [-z zipf_exponent]\n"
+                  "       [-c packets_per_update] [-n nics] [-r] prefixes\n", prog);
+}
+
+static void print_prefix(char type, const workload_prefix *prefix) {
+  printf("%c %u.%u.%u.%u/%u", type, (prefix->ip >> 24) & 0xFF, (prefix->ip >> 16) & 0xFF,
+         (prefix->ip >> 8) & 0xFF, prefix->ip & 0xFF, prefix->netsize);
+}
+
+/* An update of a random prefix of the table: for ip_forward a new NIC
+ * or (half of the time) a deletion, for ip_route a distance vector
+ * entry from a random NIC, unreachable one time in ten.
+ */
+static void print_update(workload_rng *rng, const workload_prefix *prefixes, size_t n,
+                         int route, unsigned int nics, unsigned int id) {
+  const workload_prefix *prefix = &prefixes[workload_below(rng, n)];
+
+  if (route) {
+    print_prefix('U', prefix);
+    printf(" %u %u %u\n", workload_below(rng, nics),
+           workload_below(rng, 10) ? workload_below(rng, 30) + 1 : METRIC_UNREACHABLE, id);
+  } else {
+    print_prefix('T', prefix);
+    printf(" %d\n", workload_below(rng, 2) ? (int) workload_below(rng, nics) : -1);
+  }
+}
 
-#define LEAD_ONES(X) 0xFFFFFFFF << (32-X)
 int main(int argc, char** argv) {
-  int i;
-  unsigned int ip, netsize;
-  srand(time(0));
-  for (i = 1; i <= atoi(argv[1]); i++) {
-    netsize = (rand() % 31) + 1;
-    ip = (rand() % (1 << netsize)) << (32-netsize);
-    // ip = ip & LEAD_ONES(netsize);
-
-    printf("T %u.%u.%u.%u/%u %d\n", (ip >> 24) & 0xFF, (ip >> 16) & 0xFF, (ip >> 8) & 0xFF, ip & 0xFF, netsize, i);
+  workload_rng rng;
+  workload_zipf zipf;
+  workload_prefix *prefixes;
+  uint32_t hot[ZIPF_HOT];
+  workload_lengths lengths = LENGTHS_UNIFORM;
+  unsigned long seed = 1, packets = 0, churn = 0, n, i;
+  double zipf_s = 0;
+  uint32_t ip;
+  unsigned int update_id = 0, nics = NUM_NICS;
+  int route = 0, opt;
+
+  while ((opt = getopt(argc, argv, "s:l:p:z:c:n:r")) != -1) {
+    switch (opt) {
+    case 's':
+      seed = strtoul(optarg, NULL, 10);
+      break;
+    case 'l':
+      if (!strcmp(optarg, "uniform"))
+        lengths = LENGTHS_UNIFORM;
+      else if (!strcmp(optarg, "bgp"))
+        lengths = LENGTHS_BGP;
+      else {
+        usage(argv[0]);
+        return 2;
+      }
+      break;
+    case 'p':
+      packets = strtoul(optarg, NULL, 10);
+      break;
+    case 'z':
+      zipf_s = strtod(optarg, NULL);
+      break;
+    case 'c':
+      churn = strtoul(optarg, NULL, 10);
+      break;
+    case 'n':
+      nics = strtoul(optarg, NULL, 10);
+      if (!nics) {
+        usage(argv[0]);
+        return 2;
+      }
+      break;
+    case 'r':
+      route = 1;
+      break;
+    default:
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if (optind + 1 != argc || !(n = strtoul(argv[optind], NULL, 10))) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  prefixes = (workload_prefix*) malloc(n * sizeof(workload_prefix));
+  if (!prefixes) {
+    perror("Could not allocate prefixes");
+    return EXIT_FAILURE;
+  }
+  workload_seed(&rng, seed);
+  workload_prefixes(&rng, lengths, prefixes, n);
+  if (zipf_s > 0) {
+    if (workload_zipf_init(&zipf, ZIPF_HOT, zipf_s)) {
+      perror("Could not allocate destinations");
+      return EXIT_FAILURE;
+    }
+    for (i = 0; i < ZIPF_HOT; i++)
+      hot[i] = workload_destination(&rng, prefixes, n);
   }
+
+  for (i = 0; i < n; i++) {
+    if (route) {
+      print_prefix('U', &prefixes[i]);
+      printf(" %u %u %u\n", workload_below(&rng, nics), workload_below(&rng, 30) + 1, update_id++);
+    } else {
+      print_prefix('T', &prefixes[i]);
+      printf(" %lu\n", i + 1);
+    }
+  }
+
+  for (i = 0; i < packets; i++) {
+    if (churn && i % churn == churn - 1)
+      print_update(&rng, prefixes, n, route, nics, update_id++);
+    ip = (zipf_s > 0) ? hot[workload_zipf_next(&zipf, &rng)] : workload_destination(&rng, prefixes, n);
+    printf("P %u.%u.%u.%u %lu\n", (ip >> 24) & 0xFF, (ip >> 16) & 0xFF, (ip >> 8) & 0xFF, ip & 0xFF, i);
+  }
+
+  if (zipf_s > 0)
+    workload_zipf_free(&zipf);
+  free(prefixes);
   return 0;
 }
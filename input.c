@@ -0,0 +1,359 @@
+/*
+ * input.c
+ * Author:
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "input.h"
+
+/* Size of the blocks read from pipes. */
+#define INPUT_BLOCK (1 << 20)
+
+/* Maps fd if it is a regular file, otherwise prepares a buffer for
+ * block reads. Returns -1 and sets errno on failure.
+ */
+int input_open(input *in, int fd) {
+  struct stat st;
+  void *data;
+
+  memset(in, 0, sizeof(input));
+  in->fd = fd;
+
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    in->eof = 1;
+    if (st.st_size == 0)
+      return 0;
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED) {
+      madvise(data, st.st_size, MADV_SEQUENTIAL);
+      in->data = (char*) data;
+      in->size = st.st_size;
+      in->mapped = 1;
+      return 0;
+    }
+    in->eof = 0;
+  }
+
+  in->capacity = INPUT_BLOCK;
+  in->data = (char*) malloc(in->capacity);
+  return in->data ? 0 : -1;
+}
+
+// Read another block after the unconsumed bytes. Return 0 at end of input.
+static int input_fill(input *in) {
+  ssize_t rc;
+
+  if (in->eof) return 0;
+  if (in->pos > 0) {
+    memmove(in->data, in->data + in->pos, in->size - in->pos);
+    in->size -= in->pos;
+    in->pos = 0;
+  }
+  if (in->size == in->capacity) {
+    in->capacity *= 2;
+    in->data = (char*) realloc(in->data, in->capacity);
+    if (!in->data) {
+      perror("Could not read input");
+      exit(EXIT_FAILURE);
+    }
+  }
+  do {
+    rc = read(in->fd, in->data + in->size, in->capacity - in->size);
+  } while (rc < 0 && errno == EINTR);
+  if (rc <= 0) {
+    in->eof = 1;
+    return 0;
+  }
+  in->size += rc;
+  return 1;
+}
+
+/* Hands out the next line, newline included, like fgets with a buffer
+ * of max bytes would: lines longer than max - 1 bytes come out in
+ * pieces. Returns 0 at end of input.
+ */
+int input_next_line(input *in, size_t max, const char **line, size_t *len) {
+  const char *start, *nl;
+  size_t avail;
+
+  for (;;) {
+    start = in->data + in->pos;
+    avail = in->size - in->pos;
+    if (avail > max - 1)
+      avail = max - 1;
+    nl = avail ? (const char*) memchr(start, '\n', avail) : NULL;
+    if (nl) {
+      avail = nl - start + 1;
+      break;
+    }
+    if (avail == max - 1 || !input_fill(in)) {
+      if (!avail) return 0;
+      break;
+    }
+  }
+  *line = start;
+  *len = avail;
+  in->pos += avail;
+  return 1;
+}
+
+// Make at least n unconsumed bytes available. Return 0 if the input ends first.
+static int input_ensure(input *in, size_t n) {
+  while (in->size - in->pos < n) {
+    if (!input_fill(in))
+      return 0;
+  }
+  return 1;
+}
+
+int input_read_trace_header(input *in) {
+  trace_header header;
+
+  if (!input_ensure(in, sizeof(header)))
+    return -1;
+  memcpy(&header, in->data + in->pos, sizeof(header));
+  if (memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) ||
+      header.version != TRACE_VERSION)
+    return -1;
+  in->pos += sizeof(header);
+  return 0;
+}
+
+int input_next_record(input *in, trace_record *rec) {
+  int size;
+
+  if (!input_ensure(in, 4))
+    return (in->size == in->pos) ? 0 : -1;
+  size = trace_record_size(in->data[in->pos]);
+  if (!size)
+    return -2;
+  if (!input_ensure(in, size))
+    return -1;
+  trace_decode(in->data + in->pos, rec);
+  in->pos += size;
+  return 1;
+}
+
+void input_close(input *in) {
+  if (in->mapped)
+    munmap(in->data, in->size);
+  else
+    free(in->data);
+  in->data = NULL;
+}
+
+
+/******************************************************************************
+ *  Record scanners
+ *****************************************************************************/
+
+typedef struct scanner {
+  const char *p, *end;
+  int count;
+  int failed;   // set once a conversion or literal fails to match
+  int ended;    // the line ended before a conversion
+} scanner;
+
+static inline int scan_is_space(char c) {
+  return c == ' ' || (unsigned char) (c - '\t') <= '\r' - '\t';
+}
+
+// Format whitespace: skip any amount of input whitespace
+static inline void scan_space(scanner *s) {
+  while (s->p < s->end && scan_is_space(*s->p))
+    s->p++;
+}
+
+// A literal character of the format
+static inline void scan_char(scanner *s, char c) {
+  if (s->failed) return;
+  if (s->p == s->end) {
+    s->failed = s->ended = 1;
+  } else if (*s->p != c) {
+    s->failed = 1;
+  } else {
+    s->p++;
+  }
+}
+
+/* A %u or %d conversion. The magnitude saturates like strtoul/strtol
+ * do, and the result is narrowed to 32 bits the way scanf does it.
+ */
+static inline int scan_number(scanner *s, unsigned long *value, int is_signed) {
+  unsigned long v, limit;
+  unsigned d;
+  int neg, overflow;
+  const char *digits;
+
+  if (s->failed) return 0;
+  scan_space(s);
+  if (s->p == s->end) {
+    s->failed = s->ended = 1;
+    return 0;
+  }
+  neg = (*s->p == '-');
+  if (neg || *s->p == '+')
+    s->p++;
+
+  v = 0;
+  overflow = 0;
+  digits = s->p;
+  while (s->p < s->end && (d = (unsigned) (*s->p - '0')) <= 9) {
+    if (v > (ULONG_MAX - d) / 10)
+      overflow = 1;
+    v = v * 10 + d;
+    s->p++;
+  }
+  if (s->p == digits) {
+    s->failed = 1;
+    return 0;
+  }
+
+  if (is_signed) {
+    limit = neg ? (unsigned long) LONG_MAX + 1 : (unsigned long) LONG_MAX;
+    if (overflow || v > limit)
+      v = limit;
+  } else if (overflow) {
+    v = ULONG_MAX;
+    neg = 0;
+  }
+  *value = neg ? -v : v;
+  s->count++;
+  return 1;
+}
+
+static inline int scan_result(scanner *s) {
+  return (s->ended && s->count == 0) ? -1 : s->count;
+}
+
+// Scan "%u.%u.%u.%u" into a host-order address
+static inline void scan_ip(scanner *s, uint32_t *ip) {
+  unsigned long octet[4];
+
+  scan_number(s, &octet[0], 0);
+  scan_char(s, '.');
+  scan_number(s, &octet[1], 0);
+  scan_char(s, '.');
+  scan_number(s, &octet[2], 0);
+  scan_char(s, '.');
+  scan_number(s, &octet[3], 0);
+  if (s->count == 4) {
+    *ip = (unsigned) octet[0] << 24 | (unsigned) octet[1] << 16 |
+          (unsigned) octet[2] << 8 | (unsigned) octet[3];
+  }
+}
+
+// Start on a line, matching the record tag unless it is 0
+static inline void scan_start(scanner *s, const char *line, size_t len, char tag) {
+  s->p = line;
+  s->end = line + len;
+  s->count = s->failed = s->ended = 0;
+  if (tag) {
+    scan_char(s, tag);
+    scan_space(s);
+  }
+}
+
+int scan_table_entry(const char *line, size_t len, uint32_t *ip, unsigned int *netsize, int *nic) {
+  scanner s;
+  unsigned long v;
+
+  scan_start(&s, line, len, 'T');
+  scan_ip(&s, ip);
+  scan_char(&s, '/');
+  if (scan_number(&s, &v, 0))
+    *netsize = (unsigned int) v;
+  scan_space(&s);
+  if (scan_number(&s, &v, 1))
+    *nic = (int) v;
+  return scan_result(&s);
+}
+
+int scan_packet(const char *line, size_t len, uint32_t *ip, unsigned int *packet_id) {
+  scanner s;
+  unsigned long v;
+
+  scan_start(&s, line, len, 'P');
+  scan_ip(&s, ip);
+  scan_space(&s);
+  if (scan_number(&s, &v, 0))
+    *packet_id = (unsigned int) v;
+  return scan_result(&s);
+}
+
+int scan_update(const char *line, size_t len, uint32_t *ip, unsigned int *netsize, int *nic,
+                unsigned int *metric, unsigned int *update_id) {
+  scanner s;
+  unsigned long v;
+
+  scan_start(&s, line, len, 'U');
+  scan_ip(&s, ip);
+  scan_char(&s, '/');
+  if (scan_number(&s, &v, 0))
+    *netsize = (unsigned int) v;
+  scan_space(&s);
+  if (scan_number(&s, &v, 1))
+    *nic = (int) v;
+  scan_space(&s);
+  if (scan_number(&s, &v, 0))
+    *metric = (unsigned int) v;
+  scan_space(&s);
+  if (scan_number(&s, &v, 0))
+    *update_id = (unsigned int) v;
+  return scan_result(&s);
+}
+
+int scan_advertisement(const char *line, size_t len, uint32_t *ip, unsigned int *netsize,
+                       unsigned int *metric, unsigned int *update_id) {
+  scanner s;
+  unsigned long v;
+
+  scan_start(&s, line, len, 'A');
+  scan_ip(&s, ip);
+  scan_char(&s, '/');
+  if (scan_number(&s, &v, 0))
+    *netsize = (unsigned int) v;
+  scan_space(&s);
+  if (scan_number(&s, &v, 0))
+    *metric = (unsigned int) v;
+  scan_space(&s);
+  if (scan_number(&s, &v, 0))
+    *update_id = (unsigned int) v;
+  return scan_result(&s);
+}
+
+int scan_output(const char *line, size_t len, unsigned int *packet_id, int *nic) {
+  scanner s;
+  unsigned long v;
+
+  scan_start(&s, line, len, 'O');
+  if (scan_number(&s, &v, 0))
+    *packet_id = (unsigned int) v;
+  scan_space(&s);
+  if (scan_number(&s, &v, 1))
+    *nic = (int) v;
+  return scan_result(&s);
+}
+
+int scan_route(const char *line, size_t len, uint32_t *ip, unsigned int *netsize, int *nic) {
+  scanner s;
+  unsigned long v;
+
+  scan_start(&s, line, len, 0);
+  scan_ip(&s, ip);
+  scan_char(&s, '/');
+  if (scan_number(&s, &v, 0))
+    *netsize = (unsigned int) v;
+  scan_space(&s);
+  if (scan_number(&s, &v, 1))
+    *nic = (int) v;
+  return scan_result(&s);
+}
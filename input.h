@@ -0,0 +1,60 @@
+/*
+ *  input.h
+ *  Author:
+ */
+
+#ifndef _INPUT_H_
+#define _INPUT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "trace.h"
+
+/* Line reader shared by ip_forward and ip_route. Regular files are
+ * mapped into memory and lines are handed out in place; pipes and
+ * terminals are read in large blocks. Lines are not NUL-terminated.
+ */
+typedef struct input {
+  int fd;
+  int mapped;
+  char *data;
+  size_t size, pos;
+  size_t capacity;
+  int eof;
+} input;
+
+int input_open(input *in, int fd);
+int input_next_line(input *in, size_t max, const char **line, size_t *len);
+void input_close(input *in);
+
+/* Binary traces (see trace.h). input_read_trace_header returns -1 if
+ * the input does not start with a valid header; input_next_record
+ * returns 1 for a record, 0 at end of input, -1 if the input ends in
+ * the middle of a record and -2 on a record of unknown type (after
+ * which the rest of the input cannot be read).
+ */
+int input_read_trace_header(input *in);
+int input_next_record(input *in, trace_record *rec);
+
+/* Record scanners. Each accepts the same text as the corresponding
+ * sscanf format and returns the number of fields converted, -1 if the
+ * line ended before the first one. Fields that were not reached are
+ * left untouched.
+ *   scan_table_entry    "T %u.%u.%u.%u/%u %d"
+ *   scan_packet         "P %u.%u.%u.%u %u"
+ *   scan_update         "U %u.%u.%u.%u/%u %d %u %u"
+ *   scan_advertisement  "A %u.%u.%u.%u/%u %u %u"
+ *   scan_output         "O %u %d"
+ *   scan_route          "%u.%u.%u.%u/%u %d" (a line of a table file)
+ */
+int scan_table_entry(const char *line, size_t len, uint32_t *ip, unsigned int *netsize, int *nic);
+int scan_packet(const char *line, size_t len, uint32_t *ip, unsigned int *packet_id);
+int scan_update(const char *line, size_t len, uint32_t *ip, unsigned int *netsize, int *nic,
+                unsigned int *metric, unsigned int *update_id);
+int scan_advertisement(const char *line, size_t len, uint32_t *ip, unsigned int *netsize,
+                       unsigned int *metric, unsigned int *update_id);
+int scan_output(const char *line, size_t len, unsigned int *packet_id, int *nic);
+int scan_route(const char *line, size_t len, uint32_t *ip, unsigned int *netsize, int *nic);
+
+#endif
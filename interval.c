@@ -0,0 +1,200 @@
+/*
+ * interval.c
+ * Author:
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <immintrin.h>
+
+#include "interval.h"
+
+/* Sorted ranges, as the flattening produces them. */
+typedef struct interval_list {
+  uint32_t *starts;
+  int *nics;
+  uint32_t count;
+} interval_list;
+
+/* Starts a range at start. A range starting at the same address is
+ * replaced, and a range with the same NIC as the one before it is
+ * merged into it.
+ */
+static void interval_emit(interval_list *list, uint32_t start, int nic) {
+  if (list->count && list->starts[list->count - 1] == start) {
+    list->nics[list->count - 1] = nic;
+    if (list->count > 1 && list->nics[list->count - 2] == nic)
+      list->count--;
+  } else if (!list->count || list->nics[list->count - 1] != nic) {
+    list->starts[list->count] = start;
+    list->nics[list->count++] = nic;
+  }
+}
+
+/* Flattens prefixes in the order of radix_prefixes, keeping the
+ * prefixes that contain the current one on a stack: when a prefix
+ * ends, the one around it takes over again.
+ */
+static void interval_flatten(interval_list *list, const radix_prefix *prefixes, uint32_t count) {
+  struct { uint64_t end; int nic; } stack[34];
+  uint32_t i;
+  uint64_t start;
+  uint8_t bits;
+  int depth;
+
+  stack[0].end = 1ULL << 32;
+  stack[0].nic = -1;
+  depth = 1;
+  interval_emit(list, 0, -1);
+  for (i = 0; i < count; i++) {
+    // a netsize past 32 is a host route, as the radix lookups take it
+    bits = min(prefixes[i].bits, 32);
+    start = prefixes[i].key;
+    while (stack[depth - 1].end <= start) {
+      depth--;
+      interval_emit(list, stack[depth].end, stack[depth - 1].nic);
+    }
+    interval_emit(list, start, prefixes[i].value);
+    stack[depth].end = start + (1ULL << (32 - bits));
+    stack[depth++].nic = prefixes[i].value;
+  }
+  while (depth > 1) {
+    depth--;
+    if (stack[depth].end < 1ULL << 32)
+      interval_emit(list, stack[depth].end, stack[depth - 1].nic);
+  }
+}
+
+// Lay out the sorted ranges from index i on in the subtree rooted at k
+static uint32_t interval_layout(interval_table *tab, const interval_list *list, uint32_t i, uint32_t k) {
+  if (k > tab->count) return i;
+  i = interval_layout(tab, list, i, 2 * k);
+  tab->bounds[k] = list->starts[i];
+  tab->nics[k] = list->nics[i++];
+  return interval_layout(tab, list, i, 2 * k + 1);
+}
+
+/* Compiles the radix tree into an interval table. The arrays of tab
+ * are reused if it is not NULL. Returns NULL (and frees tab) if memory
+ * runs out; the caller should keep using the radix tree in that case.
+ */
+interval_table* interval_build(interval_table *tab, radix_pool *pool, uint32_t tree) {
+  radix_prefix *prefixes;
+  interval_list list;
+  uint32_t count, capacity;
+
+  if (!tab) {
+    tab = (interval_table*) calloc(1, sizeof(interval_table));
+    if (!tab) return NULL;
+  }
+  prefixes = radix_prefixes(pool, tree, &count);
+  if (!prefixes) {
+    interval_free(tab);
+    return NULL;
+  }
+
+  list.count = 0;
+  list.starts = (uint32_t*) malloc((2 * (size_t) count + 1) * sizeof(uint32_t));
+  list.nics = (int*) malloc((2 * (size_t) count + 1) * sizeof(int));
+  if (list.starts && list.nics)
+    interval_flatten(&list, prefixes, count);
+  free(prefixes);
+
+  if (list.starts && list.nics && list.count + 1 > tab->capacity) {
+    free(tab->bounds);
+    free(tab->nics);
+    // whole cache lines, so that the bounds of a line sit together
+    capacity = (list.count + 16) & ~15U;
+    tab->bounds = (uint32_t*) aligned_alloc(64, capacity * sizeof(uint32_t));
+    tab->nics = (int*) malloc(capacity * sizeof(int));
+    tab->capacity = (tab->bounds && tab->nics) ? capacity : 0;
+  }
+  if (!list.starts || !list.nics || !tab->capacity) {
+    free(list.starts);
+    free(list.nics);
+    interval_free(tab);
+    return NULL;
+  }
+
+  tab->count = list.count;
+  tab->bounds[0] = 0;
+  tab->nics[0] = -1;
+  interval_layout(tab, &list, 0, 1);
+  free(list.starts);
+  free(list.nics);
+  return tab;
+}
+
+/* Looks up n (at most FORWARD_BATCH) addresses, taking every descent
+ * a level down in turn so that their cache misses overlap.
+ */
+void interval_lookup_batch(const interval_table *tab, const uint32_t *ips, int *nics, int n) {
+  uint32_t k[FORWARD_BATCH];
+  int i, done;
+
+  for (i = 0; i < n; i++)
+    k[i] = 1;
+  // all descents are as deep, give or take a level
+  for (done = 0; !done; ) {
+    done = 1;
+    for (i = 0; i < n; i++) {
+      if (k[i] > tab->count) continue;
+      __builtin_prefetch(tab->bounds + 16 * k[i]);
+      k[i] = 2 * k[i] + (tab->bounds[k[i]] <= ips[i]);
+      done = 0;
+    }
+  }
+  for (i = 0; i < n; i++)
+    nics[i] = tab->nics[k[i] >> __builtin_ffs(k[i])];
+}
+
+/* AVX2 version of interval_lookup_batch: eight descents to a vector,
+ * each taking a level per gather of the boundaries. Lanes that have
+ * reached the bottom are masked out until all have. The final shift
+ * by the position of the lowest set bit comes from the exponent of
+ * that bit converted to float. Only call it if the CPU has AVX2.
+ */
+__attribute__((target("avx2")))
+void interval_lookup_batch_avx2(const interval_table *tab, const uint32_t *ips, int *nics, int n) {
+  const __m256i sign = _mm256_set1_epi32(0x80000000);
+  const __m256i one = _mm256_set1_epi32(1);
+  const __m256i limit = _mm256_set1_epi32(tab->count + 1);
+  __m256i ip[FORWARD_BATCH / 8], k[FORWARD_BATCH / 8], active, bound, right, shift;
+  int i, v, done;
+
+  v = n / 8;
+  for (i = 0; i < v; i++) {
+    // biased by the sign bit, so that signed comparisons order them as unsigned
+    ip[i] = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*) (ips + 8 * i)), sign);
+    k[i] = one;
+  }
+  for (done = 0; !done; ) {
+    done = 1;
+    for (i = 0; i < v; i++) {
+      active = _mm256_cmpgt_epi32(limit, k[i]);
+      if (_mm256_testz_si256(active, active)) continue;
+      bound = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), (const int*) tab->bounds, k[i], active, 4);
+      right = _mm256_andnot_si256(_mm256_cmpgt_epi32(_mm256_xor_si256(bound, sign), ip[i]), active);
+      k[i] = _mm256_add_epi32(k[i], _mm256_and_si256(k[i], active));
+      k[i] = _mm256_sub_epi32(k[i], right);
+      done = 0;
+    }
+  }
+  for (i = 0; i < v; i++) {
+    shift = _mm256_and_si256(k[i], _mm256_sub_epi32(_mm256_setzero_si256(), k[i]));
+    shift = _mm256_castps_si256(_mm256_cvtepi32_ps(shift));
+    shift = _mm256_sub_epi32(_mm256_srli_epi32(shift, 23), _mm256_set1_epi32(126));
+    k[i] = _mm256_srlv_epi32(k[i], shift);
+    _mm256_storeu_si256((__m256i*) (nics + 8 * i), _mm256_i32gather_epi32(tab->nics, k[i], 4));
+  }
+  if (n > 8 * v)
+    interval_lookup_batch(tab, ips + 8 * v, nics + 8 * v, n - 8 * v);
+}
+
+void interval_free(interval_table *tab) {
+  if (!tab) return;
+  free(tab->bounds);
+  free(tab->nics);
+  free(tab);
+}
@@ -0,0 +1,52 @@
+/*
+ *  interval.h
+ *  Author:
+ */
+
+#ifndef _INTERVAL_H_
+#define _INTERVAL_H_
+
+#include <stdint.h>
+
+#include "ip_forward.h"
+
+/* The table flattened into disjoint address ranges: range i starts at
+ * the i-th boundary and ends where the next one starts, and every
+ * address in it goes to the same NIC (-1 for no route). Adjacent
+ * ranges always have different NICs, so there are at most two per
+ * prefix, plus one.
+ *
+ * Boundaries are kept in Eytzinger (breadth-first) order, 1-based:
+ * the children of entry k are 2k and 2k + 1, so the search is a
+ * branchless descent, and the 16 descendants four levels down share a
+ * cache line and can be prefetched together. The first boundary is
+ * always 0, so every address is in a range.
+ */
+typedef struct interval_table {
+  uint32_t *bounds;   // bounds[1..count], cache line aligned from index 0
+  int *nics;          // NIC of the range starting at bounds[k]
+  uint32_t count, capacity;
+} interval_table;
+
+interval_table* interval_build(interval_table *tab, radix_pool *pool, uint32_t tree);
+void interval_free(interval_table *tab);
+void interval_lookup_batch(const interval_table *tab, const uint32_t *ips, int *nics, int n);
+void interval_lookup_batch_avx2(const interval_table *tab, const uint32_t *ips, int *nics, int n);
+
+/* Returns the NIC of the longest prefix containing ip, or -1. The
+ * descent goes right past every boundary at or below ip; the range is
+ * that of the last such boundary, found by dropping the left turns
+ * after it from k.
+ */
+static inline int interval_lookup(const interval_table *tab, uint32_t ip) {
+  uint32_t k = 1;
+
+  while (k <= tab->count) {
+    __builtin_prefetch(tab->bounds + 16 * k);
+    k = 2 * k + (tab->bounds[k] <= ip);
+  }
+  k >>= __builtin_ffs(k);
+  return tab->nics[k];
+}
+
+#endif
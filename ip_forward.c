@@ -5,28 +5,189 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 
 #include "ip_forward.h"
+#include "dir24_8.h"
+#include "tree_bitmap.h"
+#include "interval.h"
+#include "ortc.h"
+#include "flow_cache.h"
+#include "latency.h"
+#include "output.h"
+#include "trace.h"
 
 /* Helper function that prints the output of a frame being forwarded. */
 static inline void print_forwarding(unsigned int packet_id, int nic) {
-  printf("O %u %d\n", packet_id, nic);
+  char *p = output_reserve(&out_stdout, OUTPUT_RECORD_MAX);
+
+  *p++ = 'O';
+  *p++ = ' ';
+  p = format_uint(p, packet_id);
+  *p++ = ' ';
+  p = format_int(p, nic);
+  *p++ = '\n';
+  output_commit(&out_stdout, p);
+}
+
+/* Same as print_forwarding, as a binary O record. */
+static inline void print_forwarding_record(unsigned int packet_id, int nic) {
+  trace_record rec;
+
+  memset(&rec, 0, sizeof(rec));
+  rec.type = 'O';
+  rec.nic = nic;
+  rec.id = packet_id;
+  trace_write_record(&out_stdout, &rec);
 }
 
 /* Helper function that prints a forwarding table entry. */
-static inline void print_forwarding_table_entry(uint32_t ip, uint8_t netsize, int nic, FILE *output) {
-  fprintf(output, "%u.%u.%u.%u/%u %d\n",
-      (ip >> 24) & 0xFF, (ip >> 16) & 0xFF, (ip >> 8) & 0xFF, ip & 0xFF, netsize, nic);
+static inline void print_forwarding_table_entry(uint32_t ip, uint8_t netsize, int nic, void *output) {
+  char *p = output_reserve(output, OUTPUT_RECORD_MAX);
+
+  p = format_ip(p, ip);
+  *p++ = '/';
+  p = format_uint(p, netsize);
+  *p++ = ' ';
+  p = format_int(p, nic);
+  *p++ = '\n';
+  output_commit(output, p);
 }
 
 /* This function initializes the state of the router.
  */
 router_state initialize_router(void) {
   router_state router = (router_state) malloc(sizeof(struct router_state));
-  router->tree = NULL;
+  radix_pool_init(&router->pool);
+  router->tree = RADIX_NIL;
+  router->engine = ENGINE_RADIX;
+  router->dir = NULL;
+  router->tbm = NULL;
+  router->intervals = NULL;
+  router->cache = NULL;
+  router->fib = NULL;
+  router->dirty = 1;
+  router->patched = 0;
+  router->simd = __builtin_cpu_supports("avx2") != 0;
+  router->binary_output = 0;
   return router;
 }
 
+/* Selects the structure used by forward_packet. */
+void set_forwarding_engine(router_state state, forward_engine engine) {
+  state->engine = engine;
+  state->dirty = 1;
+}
+
+/* Lets the batch lookups use AVX2 when the CPU has it (the default),
+ * or keeps them scalar.
+ */
+void set_simd(router_state state, int enable) {
+  state->simd = enable && __builtin_cpu_supports("avx2") != 0;
+}
+
+/* Puts a destination cache of about the given number of entries in
+ * front of the lookup engine (0 removes it). Returns -1 if out of
+ * memory.
+ */
+int set_flow_cache(router_state state, uint32_t entries) {
+  flow_cache_free(state->cache);
+  state->cache = NULL;
+  if (entries) {
+    state->cache = flow_cache_create(entries);
+    if (!state->cache) return -1;
+  }
+  return 0;
+}
+
+/* Turns aggregation of the forwarding table on or off. The FIB is
+ * built before the next lookup. Returns -1 if out of memory.
+ */
+int set_aggregation(router_state state, int enable) {
+  ortc_free(state->fib);
+  state->fib = NULL;
+  state->dirty = 1;
+  if (enable) {
+    state->fib = ortc_create();
+    if (!state->fib) return -1;
+  }
+  return 0;
+}
+
+// Whether lookups go to the aggregated tree instead of the configured one
+static inline int forward_aggregated(router_state state) {
+  return state->fib != NULL;
+}
+
+// Pool and root of the tree the lookups and the compiled tables use
+static inline radix_pool* forward_pool(router_state state) {
+  return forward_aggregated(state) ? &state->fib->pool : &state->pool;
+}
+
+static inline uint32_t forward_tree(router_state state) {
+  return forward_aggregated(state) ? state->fib->tree : state->tree;
+}
+
+/* Prints the hit and miss counts of the destination cache, if any. */
+void print_flow_cache_stats(router_state state, FILE *output) {
+  flow_cache *cache = state->cache;
+  uint64_t total;
+
+  if (!cache) return;
+  total = cache->hits + cache->misses;
+  fprintf(output, "Flow cache: %u entries, %llu hits, %llu misses (%.2f%% hit rate)\n",
+          FLOW_CACHE_WAYS << cache->set_bits, (unsigned long long) cache->hits,
+          (unsigned long long) cache->misses, total ? 100.0 * cache->hits / total : 0.0);
+}
+
+/* Brings the compiled table up to date after the lookup tree changed
+ * at ip/netsize. Only dir24-8 is patched in place, and only while the
+ * slots patched since the last lookup stay within DIR24_PATCH_BUDGET;
+ * past that, or for the other engines, the table is rebuilt before
+ * the next lookup.
+ */
+static void forward_patch(router_state state, uint32_t ip, uint8_t netsize) {
+  uint32_t slots;
+
+  if (state->dirty || state->engine != ENGINE_DIR24_8 || !state->dir) {
+    state->dirty = 1;
+    return;
+  }
+  slots = (netsize <= 24) ? 1U << (24 - netsize) : 1;
+  state->patched += min(slots, DIR24_PATCH_BUDGET + 1);
+  if (state->patched > DIR24_PATCH_BUDGET ||
+      dir24_8_patch(state->dir, forward_pool(state), forward_tree(state), ip, netsize))
+    state->dirty = 1;
+}
+
+/* Follows a change of the configured tree at ip/netsize through the
+ * FIB, if the table is aggregated, and the compiled table.
+ */
+static void forward_update(router_state state, uint32_t ip, uint8_t netsize) {
+  int rc;
+
+  // a netsize past 32 has no range to patch
+  if (netsize > 32) {
+    if (state->fib)
+      state->fib->stale = 1;
+    state->dirty = 1;
+    return;
+  }
+  if (forward_aggregated(state)) {
+    if (state->fib->stale)
+      return;
+    rc = ortc_update(state->fib, &state->pool, state->tree, ip, netsize, &ip, &netsize);
+    if (rc < 0) {
+      state->fib->stale = 1;
+      state->dirty = 1;
+    }
+    if (rc <= 0)
+      return;
+  }
+  forward_patch(state, ip, netsize);
+}
+
 /* This function is called for every line corresponding to a table
  * entry. The IP is represented as a 32-bit unsigned integer. The
  * netsize parameter corresponds to the size of the prefix
@@ -34,11 +195,178 @@ router_state initialize_router(void) {
  * printed as a result of this function.
  */
 void populate_forwarding_table(router_state *state, uint32_t ip, uint8_t netsize, int nic) {
+  uint64_t start = latency_start();
+
   // printf("\nINSERTS %u.%u.%u.%u/%u->%d:\n", (ip >> 24) & 0xFF, (ip >> 16) & 0xFF, (ip >> 8) & 0xFF, ip & 0xFF, netsize, nic);
   if (nic != -1) {
-    (*state)->tree = radix_insert((*state)->tree, netsize, ip, nic);
+    (*state)->tree = radix_insert(&(*state)->pool, (*state)->tree, netsize, ip, nic);
+    latency_record(LATENCY_INSERT, start, 1);
   } else {
-    (*state)->tree = radix_delete((*state)->tree, netsize, ip);
+    (*state)->tree = radix_delete(&(*state)->pool, (*state)->tree, netsize, ip);
+    latency_record(LATENCY_DELETE, start, 1);
+  }
+  forward_update(*state, ip, netsize);
+  if ((*state)->cache)
+    flow_cache_invalidate((*state)->cache);
+}
+
+/* Sorts entries by address and then netsize, keeping entries with the
+ * same prefix in their original order. LSD radix sort, one pass per
+ * byte of the key; tmp must hold n entries.
+ */
+static void sort_table_entries(radix_prefix *entries, radix_prefix *tmp, int n) {
+  static const int shift[] = { -1, 0, 8, 16, 24 };
+  uint32_t count[256], digit;
+  radix_prefix *from, *to, *swap;
+  int pass, i;
+
+  from = entries;
+  to = tmp;
+  for (pass = 0; pass < 5; pass++) {
+    memset(count, 0, sizeof(count));
+    for (i = 0; i < n; i++) {
+      digit = (shift[pass] < 0) ? from[i].bits : (from[i].key >> shift[pass]) & 0xFF;
+      count[digit]++;
+    }
+    for (i = 0, digit = 0; i < 256; i++) {
+      uint32_t c = count[i];
+      count[i] = digit;
+      digit += c;
+    }
+    for (i = 0; i < n; i++) {
+      digit = (shift[pass] < 0) ? from[i].bits : (from[i].key >> shift[pass]) & 0xFF;
+      to[count[digit]++] = from[i];
+    }
+    swap = from;
+    from = to;
+    to = swap;
+  }
+  // an odd number of passes leaves the result in tmp
+  memcpy(entries, from, n * sizeof(radix_prefix));
+}
+
+/* Same as calling populate_forwarding_table for each of the n entries
+ * in order (entries is reordered in the process). When the table is
+ * still empty the entries are sorted and the tree is built in a
+ * single pass instead, which gives the same tree. Entries with host
+ * bits set or a netsize over 32 fall back to one insert each, since
+ * the tree they produce depends on the insertion order.
+ */
+void load_forwarding_table(router_state *state, radix_prefix *entries, int n) {
+  radix_prefix *tmp;
+  int i, j;
+
+  for (i = 0; i < n; i++) {
+    if (entries[i].bits > 32 || (entries[i].key & ~PREFIX_MASK(entries[i].bits)))
+      break;
+  }
+  tmp = ((*state)->tree == RADIX_NIL && i == n) ?
+      (radix_prefix*) malloc(n * sizeof(radix_prefix)) : NULL;
+  if (!tmp) {
+    for (i = 0; i < n; i++)
+      populate_forwarding_table(state, entries[i].key, entries[i].bits, entries[i].value);
+    return;
+  }
+  sort_table_entries(entries, tmp, n);
+  free(tmp);
+
+  // The last entry for a prefix wins; a deletion leaves nothing
+  for (i = j = 0; i < n; i++) {
+    if (i + 1 < n && entries[i + 1].key == entries[i].key && entries[i + 1].bits == entries[i].bits)
+      continue;
+    if (entries[i].value != -1)
+      entries[j++] = entries[i];
+  }
+  (*state)->tree = radix_build(&(*state)->pool, entries, j);
+  (*state)->dirty = 1;
+  if ((*state)->fib)
+    (*state)->fib->stale = 1;
+  if ((*state)->cache)
+    flow_cache_invalidate((*state)->cache);
+}
+
+// Bring the compiled table of the selected engine up to date
+static inline void forward_compile(router_state state) {
+  state->patched = 0;
+  if (!state->dirty) return;
+  if (forward_aggregated(state) && state->fib->stale)
+    state->fib = ortc_build(state->fib, &state->pool, state->tree);
+  if (state->engine == ENGINE_DIR24_8)
+    state->dir = dir24_8_build(state->dir, forward_pool(state), forward_tree(state));
+  else if (state->engine == ENGINE_TREE_BITMAP)
+    state->tbm = tree_bitmap_build(state->tbm, forward_pool(state), forward_tree(state));
+  else if (state->engine == ENGINE_INTERVAL)
+    state->intervals = interval_build(state->intervals, forward_pool(state), forward_tree(state));
+  state->dirty = 0;
+}
+
+// Longest prefix match on the selected engine, -1 if there is no route
+static inline int forward_engine_lookup(router_state state, uint32_t ip) {
+  int rc, nic;
+
+  if (state->engine == ENGINE_DIR24_8 && state->dir)
+    return dir24_8_lookup(state->dir, ip);
+  if (state->engine == ENGINE_TREE_BITMAP && state->tbm)
+    return tree_bitmap_lookup(state->tbm, ip);
+  if (state->engine == ENGINE_INTERVAL && state->intervals)
+    return interval_lookup(state->intervals, ip);
+  rc = radix_prefix_lookup(forward_pool(state), forward_tree(state), 32, ip, &nic);
+  return (rc == FOUND) ? nic : -1;
+}
+
+static inline void forward_engine_lookup_batch(router_state state, const uint32_t *ips, int *nics, int n) {
+  if (state->engine == ENGINE_DIR24_8 && state->dir && state->simd)
+    dir24_8_lookup_batch_avx2(state->dir, ips, nics, n);
+  else if (state->engine == ENGINE_DIR24_8 && state->dir)
+    dir24_8_lookup_batch(state->dir, ips, nics, n);
+  else if (state->engine == ENGINE_TREE_BITMAP && state->tbm)
+    tree_bitmap_lookup_batch(state->tbm, ips, nics, n);
+  else if (state->engine == ENGINE_INTERVAL && state->intervals && state->simd)
+    interval_lookup_batch_avx2(state->intervals, ips, nics, n);
+  else if (state->engine == ENGINE_INTERVAL && state->intervals)
+    interval_lookup_batch(state->intervals, ips, nics, n);
+  else
+    radix_prefix_lookup_batch(forward_pool(state), forward_tree(state), ips, nics, n);
+}
+
+// Same, through the destination cache when there is one
+static inline int forward_lookup(router_state state, uint32_t ip) {
+  int nic;
+
+  forward_compile(state);
+  if (!state->cache)
+    return forward_engine_lookup(state, ip);
+  if (!flow_cache_lookup(state->cache, ip, &nic)) {
+    nic = forward_engine_lookup(state, ip);
+    flow_cache_insert(state->cache, ip, nic);
+  }
+  return nic;
+}
+
+/* Batch version of forward_lookup: only the destinations missing from
+ * the cache go to the engine, still as one interleaved batch.
+ */
+static inline void forward_lookup_batch(router_state state, const uint32_t *ips, int *nics, int n) {
+  uint32_t miss_ips[FORWARD_BATCH];
+  int miss_nics[FORWARD_BATCH], miss_index[FORWARD_BATCH];
+  int i, misses;
+
+  if (!state->cache) {
+    forward_engine_lookup_batch(state, ips, nics, n);
+    return;
+  }
+  misses = 0;
+  for (i = 0; i < n; i++) {
+    if (!flow_cache_lookup(state->cache, ips[i], &nics[i])) {
+      miss_ips[misses] = ips[i];
+      miss_index[misses++] = i;
+    }
+  }
+  if (!misses) return;
+  forward_engine_lookup_batch(state, miss_ips, miss_nics, misses);
+  for (i = 0; i < misses; i++) {
+    nics[miss_index[i]] = miss_nics[i];
+    flow_cache_insert(state->cache, miss_ips[i], miss_nics[i]);
   }
 }
 
@@ -51,10 +379,53 @@ void populate_forwarding_table(router_state *state, uint32_t ip, uint8_t netsize
  * called in this case).
  */
 void forward_packet(router_state state, uint32_t ip, unsigned int packet_id) {
-  int rc, nic;
+  uint64_t start = latency_start();
+
+  if (state->binary_output)
+    print_forwarding_record(packet_id, forward_lookup(state, ip));
+  else
+    print_forwarding(packet_id, forward_lookup(state, ip));
+  latency_record(LATENCY_LOOKUP, start, 1);
+}
+
+/* Same as calling forward_packet for each of the n packets in order,
+ * but the lookups of up to FORWARD_BATCH packets are interleaved so
+ * that their cache misses overlap. Each packet of a group is timed as
+ * an equal share of the group.
+ */
+void forward_packet_batch(router_state state, const uint32_t *ips, const unsigned *ids, int n) {
+  int nics[FORWARD_BATCH];
+  int i, m;
+  uint64_t start = latency_start();
+
+  forward_compile(state);
+  for (; n > 0; n -= m, ips += m, ids += m, start = latency_start()) {
+    m = min(n, FORWARD_BATCH);
+    forward_lookup_batch(state, ips, nics, m);
+    if (state->binary_output) {
+      for (i = 0; i < m; i++)
+        print_forwarding_record(ids[i], nics[i]);
+    } else {
+      for (i = 0; i < m; i++)
+        print_forwarding(ids[i], nics[i]);
+    }
+    latency_record(LATENCY_LOOKUP, start, m);
+  }
+}
+
+/* Looks up the NICs of n packets without printing anything, in groups
+ * of FORWARD_BATCH like forward_packet_batch.
+ */
+void lookup_packet_batch(router_state state, const uint32_t *ips, int *nics, int n) {
+  int m;
+  uint64_t start = latency_start();
 
-  rc = radix_prefix_lookup(state->tree, 32, ip, &nic);
-  print_forwarding(packet_id, (rc == FOUND) ? nic : -1);
+  forward_compile(state);
+  for (; n > 0; n -= m, ips += m, nics += m, start = latency_start()) {
+    m = min(n, FORWARD_BATCH);
+    forward_lookup_batch(state, ips, nics, m);
+    latency_record(LATENCY_LOOKUP, start, m);
+  }
 }
 
 /* Prints the current state of the router forwarding table. This
@@ -63,29 +434,193 @@ void forward_packet(router_state state, uint32_t ip, unsigned int packet_id) {
  * address (or in order of netsize if prefix is the same).
  */
 void print_router_state(router_state state, FILE *output) {
-  radix_inorder_print(state->tree, 0, 0, print_forwarding_table_entry, output);
+  outbuf *table;
+
+  table = (outbuf*) malloc(sizeof(outbuf));
+  fflush(output);
+  output_init(table, fileno(output));
+  radix_inorder_print(&state->pool, state->tree, 0, 0, print_forwarding_table_entry, table);
+  output_flush(table);
+  free(table);
+}
+
+/* Prints the shape of the tree, the memory used by the engine and,
+ * when compiled in, the hot-path counters.
+ */
+void print_router_stats(router_state state, FILE *output) {
+  static const char *engine_names[] = { "radix", "dir24-8", "tree-bitmap", "interval" };
+  radix_counters *counters = &state->pool.counters;
+  radix_stats stats;
+  uint32_t depth;
+
+  radix_tree_stats(&state->pool, state->tree, &stats);
+  fprintf(output, "Router stats (%s engine%s)\n", engine_names[state->engine],
+          state->simd && (state->engine == ENGINE_DIR24_8 || state->engine == ENGINE_INTERVAL) ?
+          ", AVX2 batches" : "");
+  fprintf(output, "  nodes %u: %u with a value, %u internal; %u free\n",
+          stats.nodes, stats.valued, stats.internal, stats.free);
+  fprintf(output, "  pool %zu bytes allocated, %zu used (%zu per node)\n",
+          stats.bytes_allocated, stats.bytes_used, sizeof(radix_node));
+  fprintf(output, "  depth max %u, average %.2f over prefixes\n  depth histogram:",
+          stats.max_depth, stats.valued ? (double) stats.valued_depth_sum / stats.valued : 0.0);
+  for (depth = 1; depth <= stats.max_depth; depth++)
+    fprintf(output, " %u:%u", depth, stats.depth[depth]);
+  fprintf(output, "\n");
+  if (state->engine == ENGINE_DIR24_8 && state->dir)
+    fprintf(output, "  dir24-8 %zu bytes tbl24, %u chunks (%zu bytes)%s\n",
+            DIR24_TBL24_SIZE * sizeof(uint32_t), state->dir->num_chunks - state->dir->num_free,
+            (size_t) state->dir->max_chunks * DIR24_CHUNK_SIZE * sizeof(uint32_t),
+            state->dirty ? ", out of date" : "");
+  if (state->engine == ENGINE_TREE_BITMAP && state->tbm)
+    fprintf(output, "  tree-bitmap %u nodes (%zu bytes), %u prefixes (%zu bytes), %.1f bytes per prefix%s\n",
+            state->tbm->num_nodes, (size_t) state->tbm->num_nodes * sizeof(tbm_node),
+            state->tbm->num_results, (size_t) state->tbm->num_results * sizeof(int),
+            state->tbm->num_results ? (double) (state->tbm->num_nodes * sizeof(tbm_node) +
+                                                state->tbm->num_results * sizeof(int)) /
+                                      state->tbm->num_results : 0.0,
+            state->dirty ? ", out of date" : "");
+  if (state->engine == ENGINE_INTERVAL && state->intervals)
+    fprintf(output, "  interval %u ranges (%zu bytes)%s\n", state->intervals->count,
+            (size_t) state->intervals->capacity * (sizeof(uint32_t) + sizeof(int)),
+            state->dirty ? ", out of date" : "");
+  if (state->fib)
+    fprintf(output, "  aggregated to %u prefixes (%.1f%% of %u)%s\n", state->fib->num_prefixes,
+            stats.valued ? 100.0 * state->fib->num_prefixes / stats.valued : 0.0, stats.valued,
+            state->fib->stale ? ", out of date" : "");
+#ifdef ROUTER_STATS
+  fprintf(output, "  lookups %llu, %.2f nodes visited on average\n",
+          (unsigned long long) counters->lookups,
+          counters->lookups ? (double) counters->visited / counters->lookups : 0.0);
+  fprintf(output, "  inserts %llu, deletes %llu, splits %llu, merges %llu\n",
+          (unsigned long long) counters->inserts, (unsigned long long) counters->deletes,
+          (unsigned long long) counters->splits, (unsigned long long) counters->merges);
+#else
+  (void) counters;
+#endif
+  print_flow_cache_stats(state, output);
 }
 
-void radix_inorder_print(radix_node *tree, uint8_t prefix_bits, uint32_t prefix,
-    void (*fn)(uint32_t, uint8_t, int, FILE*), FILE* out) {
+/* Calls fn for every prefix with a value, in order of prefix address
+ * (shorter prefixes first). Preorder walk with an explicit stack.
+ */
+void radix_inorder_print(radix_pool *pool, uint32_t tree, uint8_t prefix_bits, uint32_t prefix,
+    void (*fn)(uint32_t, uint8_t, int, void*), void *arg) {
+  struct { uint32_t tree, prefix; uint8_t prefix_bits; } stack[66];
   uint32_t key;
   uint8_t bits;
+  radix_node *node;
+  int depth;
+
+  depth = 0;
+  if (tree != RADIX_NIL) {
+    stack[0].tree = tree;
+    stack[0].prefix = prefix;
+    stack[0].prefix_bits = prefix_bits;
+    depth = 1;
+  }
+  while (depth > 0) {
+    depth--;
+    node = RADIX_NODE(pool, stack[depth].tree);
+    prefix_bits = stack[depth].prefix_bits;
+    bits = prefix_bits + node->bits;
+    key = stack[depth].prefix + (node->key >> prefix_bits);
+    if (node->has_value)
+      fn(key, bits, node->value, arg);
+
+    // the children only take the prefix, not host bits past it
+    key &= PREFIX_MASK(bits);
+    if (node->right) {
+      stack[depth].tree = node->right;
+      stack[depth].prefix = key;
+      stack[depth++].prefix_bits = bits;
+    }
+    if (node->left) {
+      stack[depth].tree = node->left;
+      stack[depth].prefix = key;
+      stack[depth++].prefix_bits = bits;
+    }
+  }
+}
+
+/* Prefixes collected by radix_prefixes. */
+typedef struct radix_prefix_list {
+  radix_prefix *entries;
+  uint32_t count, capacity;
+  int failed;
+} radix_prefix_list;
+
+static void radix_collect(uint32_t ip, uint8_t netsize, int nic, void *arg) {
+  radix_prefix_list *list = (radix_prefix_list*) arg;
+  radix_prefix *entries;
+
+  if (list->failed) return;
+  if (list->count == list->capacity) {
+    list->capacity *= 2;
+    entries = (radix_prefix*) realloc(list->entries, list->capacity * sizeof(radix_prefix));
+    if (!entries) {
+      list->failed = 1;
+      return;
+    }
+    list->entries = entries;
+  }
+  list->entries[list->count].key = ip & PREFIX_MASK(min(netsize, 32));
+  list->entries[list->count].bits = netsize;
+  list->entries[list->count++].value = nic;
+}
 
-  if (tree) {
-    bits = prefix_bits + tree->bits;
-    key = prefix + (tree->key >> prefix_bits);
-    if (tree->has_value)
-      fn(key, bits, tree->value, out);
-    radix_inorder_print(tree->left, prefix_bits + tree->bits, key, fn, out);
-    radix_inorder_print(tree->right, prefix_bits + tree->bits, key, fn, out);
+/* Returns the prefixes of the tree in a new array, in the order of
+ * radix_inorder_print: the prefixes under any bit string are
+ * contiguous, and each comes after the ones that contain it. Returns
+ * NULL if memory runs out.
+ */
+radix_prefix* radix_prefixes(radix_pool *pool, uint32_t tree, uint32_t *count) {
+  radix_prefix_list list;
+
+  list.capacity = 1024;
+  list.count = 0;
+  list.failed = 0;
+  list.entries = (radix_prefix*) malloc(list.capacity * sizeof(radix_prefix));
+  if (!list.entries) return NULL;
+  radix_inorder_print(pool, tree, 0, 0, radix_collect, &list);
+  if (list.failed) {
+    free(list.entries);
+    return NULL;
   }
+  *count = list.count;
+  return list.entries;
 }
 
-void free_radix(radix_node *tree) {
-  if (!tree) return;
-  free_radix(tree->left);
-  free_radix(tree->right);
-  free(tree);
+/* Finds the part of the tree under key/bits. Returns the root of the
+ * subtree holding the prefixes of bits bits or more under key/bits
+ * (RADIX_NIL if there are none), with the path above it in
+ * prefix_bits and prefix, as radix_inorder_print takes them. value is
+ * set to the value of the longest shorter prefix containing key/bits,
+ * and left as it is if there is none.
+ */
+uint32_t radix_subtree(radix_pool *pool, uint32_t tree, uint8_t bits, uint32_t key,
+                       uint8_t *prefix_bits, uint32_t *prefix, int *value) {
+  radix_node *node;
+  uint32_t node_key;
+  uint8_t node_bits;
+
+  key &= PREFIX_MASK(bits);
+  *prefix_bits = 0;
+  *prefix = 0;
+  while (tree != RADIX_NIL) {
+    node = RADIX_NODE(pool, tree);
+    node_bits = *prefix_bits + node->bits;
+    node_key = *prefix + (node->key >> *prefix_bits);
+    if ((node_key ^ key) & PREFIX_MASK(min(node_bits, bits)))
+      return RADIX_NIL;
+    if (node_bits >= bits)
+      return tree;
+    if (node->has_value)
+      *value = node->value;
+    *prefix_bits = node_bits;
+    *prefix = node_key & PREFIX_MASK(node_bits);
+    tree = ((key << node_bits) & 0x80000000) ? node->right : node->left;
+  }
+  return RADIX_NIL;
 }
 
 /* Destroys all memory dynamically allocated through this state (such
@@ -93,8 +628,18 @@ void free_radix(radix_node *tree) {
  * router.
  */
 void destroy_router(router_state state) {
-  free_radix(state->tree);
-  state->tree = NULL;
+  radix_pool_destroy(&state->pool);
+  state->tree = RADIX_NIL;
+  dir24_8_free(state->dir);
+  state->dir = NULL;
+  tree_bitmap_free(state->tbm);
+  state->tbm = NULL;
+  interval_free(state->intervals);
+  state->intervals = NULL;
+  flow_cache_free(state->cache);
+  state->cache = NULL;
+  ortc_free(state->fib);
+  state->fib = NULL;
 }
 
 
@@ -103,258 +648,523 @@ void destroy_router(router_state state) {
  *****************************************************************************/
 
 
-radix_node* 
-radix_insert(radix_node *tree, uint8_t bits, uint32_t key, int value) {
-  radix_node *new_tree;
-  uint8_t bits_rmd, bits_match;
+/* Sets up an empty node pool. Nodes are carved out of fixed-size slabs
+ * that never move, so they are named by 32-bit indices instead of
+ * pointers. Index 0 is never handed out and stands for "no node".
+ */
+void radix_pool_init(radix_pool *pool) {
+  pool->slabs = (radix_node**) calloc(RADIX_MAX_SLABS, sizeof(radix_node*));
+  pool->num_slabs = 0;
+  pool->next = 1;
+  pool->free_list = RADIX_NIL;
+  pool->image = NULL;
+  pool->image_size = 0;
+  pool->image_slabs = 0;
+  pool->cow = 0;
+  pool->epoch = 0;
+  pool->retired = NULL;
+  pool->retired_head = pool->num_retired = pool->max_retired = 0;
+  memset(&pool->counters, 0, sizeof(radix_counters));
+}
 
-  // calculate number
-  if (tree && tree->bits) {
-    bits_match = num_prefix_match(tree->key, tree->bits, key, bits);
-  } 
-  // Is at root
-  else if (tree) {
-    if (NTH_MSB(key, 1) && tree->right) {
-      tree->right =  radix_insert(tree->right, bits, key, value);
-    } else if (!NTH_MSB(key, 1) && tree->left) {
-      tree->left =  radix_insert(tree->left, bits, key, value);
+// Frees every node of the pool at once
+void radix_pool_destroy(radix_pool *pool) {
+  uint32_t i;
+
+  for (i = pool->image_slabs; i < pool->num_slabs; i++)
+    free(pool->slabs[i]);
+  if (pool->image)
+    munmap(pool->image, pool->image_size);
+  pool->image = NULL;
+  pool->image_size = 0;
+  pool->image_slabs = 0;
+  free(pool->slabs);
+  pool->slabs = NULL;
+  pool->num_slabs = 0;
+  pool->next = 1;
+  pool->free_list = RADIX_NIL;
+  free(pool->retired);
+  pool->retired = NULL;
+  pool->retired_head = pool->num_retired = pool->max_retired = 0;
+}
+
+// Return the index of a new node, recycling deleted nodes first
+uint32_t radix_node_alloc(radix_pool *pool) {
+  uint32_t index;
+
+  if (pool->free_list != RADIX_NIL) {
+    index = pool->free_list;
+    pool->free_list = RADIX_NODE(pool, index)->left;
+    return index;
+  }
+  if ((pool->next >> RADIX_SLAB_BITS) == pool->num_slabs) {
+    if (pool->num_slabs == RADIX_MAX_SLABS) {
+      fprintf(stderr, "Forwarding table is full\n");
+      exit(EXIT_FAILURE);
     }
-    return tree;
-  } else {
-    new_tree = (radix_node*) malloc(sizeof(radix_node));
-    new_tree->bits = bits;
-    new_tree->key = key;
-    new_tree->has_value = 1;
-    new_tree->value = value;
-    new_tree->left = new_tree->right = NULL;
-    return new_tree;
-  }
-
-  // no match
-  if (!bits_match) {
-      radix_node* new_tree = (radix_node*) malloc(sizeof(radix_node));
-      new_tree->bits = 0;
-      new_tree->key = 0;
-      new_tree->has_value = 0;
-      new_tree->value = 0;
-      if (NTH_MSB(key, 1)) {
-        new_tree->right = radix_insert(NULL, bits, key, value);
-        new_tree->left = tree;
-      } else {
-        new_tree->left = radix_insert(NULL, bits, key, value);
-        new_tree->right = tree;
-      }
-      return new_tree;
+    pool->slabs[pool->num_slabs] = (radix_node*) malloc(RADIX_SLAB_SIZE * sizeof(radix_node));
+    if (!pool->slabs[pool->num_slabs]) {
+      perror("Could not allocate forwarding table");
+      exit(EXIT_FAILURE);
+    }
+    pool->num_slabs++;
   }
+  return pool->next++;
+}
 
-  // Same key
-  if (tree->bits == bits_match && bits == bits_match) {
-    tree->value = value;
-    tree->has_value = 1;
-  } 
+void radix_node_free(radix_pool *pool, uint32_t index) {
+  RADIX_NODE(pool, index)->left = pool->free_list;
+  pool->free_list = index;
+}
 
-  // This node's key is a prefix to the new node's key
-  else if (tree->bits == bits_match && bits > bits_match) {
-    bits_rmd = bits - bits_match;
-    if (NTH_MSB(key, bits_match + 1)) {
-      tree->right = radix_insert(tree->right, bits_rmd, key << bits_match, value);
-    } else {
-      tree->left = radix_insert(tree->left, bits_rmd, key << bits_match, value);
+// Queue a node that lookups may still be reading, tagged with the current epoch
+static void radix_retire(radix_pool *pool, uint32_t index) {
+  if (pool->num_retired == pool->max_retired) {
+    pool->max_retired = pool->max_retired ? pool->max_retired * 2 : 1024;
+    pool->retired = (radix_retired*) realloc(pool->retired, pool->max_retired * sizeof(radix_retired));
+    if (!pool->retired) {
+      perror("Could not allocate forwarding table");
+      exit(EXIT_FAILURE);
     }
   }
+  pool->retired[pool->num_retired].node = index;
+  pool->retired[pool->num_retired++].epoch = pool->epoch;
+}
+
+/* Frees the nodes retired in epochs up to epoch, which the caller
+ * guarantees no lookup can reach any more: every lookup still running
+ * started in epoch or later. Nodes are retired in epoch order, so they
+ * are freed from the front of the queue.
+ */
+void radix_reclaim(radix_pool *pool, uint32_t epoch) {
+  while (pool->retired_head < pool->num_retired &&
+         pool->retired[pool->retired_head].epoch <= epoch)
+    radix_node_free(pool, pool->retired[pool->retired_head++].node);
+  if (pool->retired_head == pool->num_retired) {
+    pool->retired_head = pool->num_retired = 0;
+  } else if (pool->retired_head > pool->num_retired / 2) {
+    pool->num_retired -= pool->retired_head;
+    memmove(pool->retired, pool->retired + pool->retired_head, pool->num_retired * sizeof(radix_retired));
+    pool->retired_head = 0;
+  }
+}
+
+// Free a node that is no longer in the tree, or retire it in copy-on-write mode
+static inline void radix_release(radix_pool *pool, uint32_t index) {
+  if (pool->cow)
+    radix_retire(pool, index);
+  else
+    radix_node_free(pool, index);
+}
+
+/* Return the node to change in place of index: index itself, or in
+ * copy-on-write mode a copy of it (the original is retired).
+ */
+static inline uint32_t radix_writable(radix_pool *pool, uint32_t index) {
+  uint32_t copy;
+
+  if (!pool->cow)
+    return index;
+  copy = radix_node_alloc(pool);
+  *RADIX_NODE(pool, copy) = *RADIX_NODE(pool, index);
+  radix_retire(pool, index);
+  return copy;
+}
+
+// Return a new node with a value and no children
+static uint32_t radix_new_leaf(radix_pool *pool, uint8_t bits, uint32_t key, int value) {
+  uint32_t index;
+  radix_node *node;
+
+  index = radix_node_alloc(pool);
+  node = RADIX_NODE(pool, index);
+  node->bits = bits;
+  node->key = key;
+  node->has_value = 1;
+  node->value = value;
+  node->left = node->right = RADIX_NIL;
+  return index;
+}
+
+/* Inserts key/bits with the given value and returns the new root.
+ * Walks down from the root keeping only the link (the parent's child
+ * index) that may have to be replaced; nothing changes on the way back
+ * up, so no recursion is needed. In copy-on-write mode every node on
+ * the way is replaced by a copy, and the links are those of the copies.
+ */
+uint32_t
+radix_insert(radix_pool *pool, uint32_t tree, uint8_t bits, uint32_t key, int value) {
+  radix_node *node, *new_node;
+  uint32_t new_tree, *link;
+  uint8_t bits_rmd, bits_match;
+
+  RADIX_COUNT(pool, inserts, 1);
+  link = &tree;
+  for (;;) {
+    if (*link == RADIX_NIL) {
+      *link = radix_new_leaf(pool, bits, key, value);
+      return tree;
+    }
+    *link = radix_writable(pool, *link);
+    node = RADIX_NODE(pool, *link);
+    bits_match = num_prefix_match(node->key, node->bits, key, bits);
+
+    // This node's key is a prefix to the new node's key, go down
+    if (node->bits == bits_match && bits > bits_match) {
+      bits -= bits_match;
+      key <<= bits_match;
+      link = NTH_MSB(key, 1) ? &node->right : &node->left;
+      continue;
+    }
+    break;
+  }
+
+  // Same key
+  if (node->bits == bits_match && bits == bits_match) {
+    node->value = value;
+    node->has_value = 1;
+    return tree;
+  }
+
+  // Split this node: its first bits_match bits stay here, the rest
+  // moves to a new child
+  RADIX_COUNT(pool, splits, 1);
+  bits_rmd = node->bits - bits_match;
+  new_tree = radix_node_alloc(pool);
+  new_node = RADIX_NODE(pool, new_tree);
+  new_node->bits = bits_rmd;
+  new_node->key = node->key << bits_match;
+  new_node->left = node->left;
+  new_node->right = node->right;
+  new_node->has_value = node->has_value;
+  new_node->value = node->value;
+  node->key = key & PREFIX_MASK(bits_match);
+  node->bits = bits_match;
 
   // new node's key is a prefix to this node's key
-  else if (tree->bits > bits_match && bits == bits_match) {
-    bits_rmd = tree->bits - bits_match;
-    new_tree = (radix_node*) malloc(sizeof(radix_node));
-    new_tree->bits = bits_rmd;
-    new_tree->key = tree->key << bits_match;
-    new_tree->left = tree->left;
-    new_tree->right = tree->right;
-    new_tree->has_value = tree->has_value;
-    new_tree->value = tree->value;
-
-    if (NTH_MSB(tree->key, bits_match + 1)) {
-      tree->right = new_tree;
-      tree->left = NULL;
+  if (bits == bits_match) {
+    if (NTH_MSB(new_node->key, 1)) {
+      node->right = new_tree;
+      node->left = RADIX_NIL;
     } else {
-      tree->right = NULL;
-      tree->left = new_tree;
+      node->right = RADIX_NIL;
+      node->left = new_tree;
     }
-    tree->bits = bits;
-    tree->value = value;
-    tree->has_value = 1;
-    tree->key = key & LEADING_ONES_32(bits_match);
+    node->value = value;
+    node->has_value = 1;
   }
 
   // The leading bits match is a prefix to both this node and the new node
   else {
     bits_rmd = bits - bits_match;
-    new_tree = (radix_node*) malloc(sizeof(radix_node));
-    new_tree->bits = tree->bits - bits_match;
-    new_tree->key = tree->key << bits_match;
-    new_tree->left = tree->left;
-    new_tree->right = tree->right;
-    new_tree->has_value = tree->has_value;
-    new_tree->value = tree->value;
-
     if (NTH_MSB(key, bits_match + 1)) {
-      tree->right = radix_insert(NULL, bits_rmd, key << bits_match, value);
-      tree->left = new_tree;
-
+      node->right = radix_new_leaf(pool, bits_rmd, key << bits_match, value);
+      node->left = new_tree;
     } else {
-      tree->left= radix_insert(NULL, bits_rmd, key << bits_match, value);
-      tree->right = new_tree;
+      node->left = radix_new_leaf(pool, bits_rmd, key << bits_match, value);
+      node->right = new_tree;
     }
-
-    tree->key = key & LEADING_ONES_32(bits_match);
-    tree->bits = bits_match;
-    tree->has_value = 0;
-    tree->value = 0;
+    node->has_value = 0;
+    node->value = 0;
   }
 
   return tree;
 }
 
-radix_node* radix_delete(radix_node *tree, uint8_t bits, uint32_t key) {
-  uint8_t bits_match, bits_rmd;
-  radix_node* new_tree;
+// Hang child, whose prefix is prefix/bits, under the parent node at depth parent_bits
+static void radix_link(radix_pool *pool, uint32_t parent, uint8_t parent_bits,
+    uint32_t child, uint32_t prefix, uint8_t bits) {
+  radix_node *node;
 
-  // printf("delete %u/%u\n", key, bits);
-  // printf("prefix %u/%u\n", tree->key, tree->bits);
-  if (tree) {
-    bits_match = num_prefix_match(tree->key, tree->bits, key, bits);
-    bits_rmd = bits - bits_match;
-  } else {
-    return NULL;
-  }
+  node = RADIX_NODE(pool, child);
+  node->key = prefix << parent_bits;
+  node->bits = bits - parent_bits;
+  if (NTH_MSB(node->key, 1))
+    RADIX_NODE(pool, parent)->right = child;
+  else
+    RADIX_NODE(pool, parent)->left = child;
+}
 
-  // This node's key is only a prefix, try to delete in subtree
-  if (bits && bits_rmd) {
+/* Builds the tree holding n distinct prefixes without host bits,
+ * sorted by address and then length, and returns its root. In that
+ * order the prefixes come in preorder, so one pass that keeps the
+ * rightmost path on a stack is enough: a node is linked to its parent
+ * when it leaves the stack, and a node without a value is added where
+ * two paths part. The result is the tree the same prefixes would get
+ * from radix_insert.
+ */
+uint32_t radix_build(radix_pool *pool, const radix_prefix *prefixes, int n) {
+  struct { uint32_t tree, prefix; uint8_t bits; } stack[34], child;
+  uint32_t key, branch;
+  uint8_t bits, match;
+  radix_node *node;
+  int i, depth;
 
-    // try to delete from subtree first
-    if (NTH_MSB(key, bits_match + 1)) {
-      tree->right = radix_delete(tree->right, bits_rmd,
-          key << bits_match);
+  RADIX_COUNT(pool, inserts, n);
+  depth = 0;
+  for (i = 0; i < n; i++) {
+    key = prefixes[i].key;
+    bits = prefixes[i].bits;
+    if (depth > 0) {
+      match = num_prefix_match(stack[depth - 1].prefix, stack[depth - 1].bits, key, bits);
 
-    } else {
-      tree->left = radix_delete(tree->left, bits_rmd,
-          key << bits_match);
+      // Close the nodes of the path that this prefix leaves
+      while (depth > 0 && stack[depth - 1].bits > match) {
+        child = stack[--depth];
+        if (depth > 0 && stack[depth - 1].bits >= match) {
+          radix_link(pool, stack[depth - 1].tree, stack[depth - 1].bits,
+                     child.tree, child.prefix, child.bits);
+          continue;
+        }
+        branch = radix_node_alloc(pool);
+        node = RADIX_NODE(pool, branch);
+        node->has_value = 0;
+        node->value = 0;
+        node->left = node->right = RADIX_NIL;
+        radix_link(pool, branch, match, child.tree, child.prefix, child.bits);
+        stack[depth].tree = branch;
+        stack[depth].prefix = key & PREFIX_MASK(match);
+        stack[depth++].bits = match;
+      }
     }
+    stack[depth].tree = radix_new_leaf(pool, bits, key, prefixes[i].value);
+    stack[depth].prefix = key;
+    stack[depth++].bits = bits;
+  }
+  if (depth == 0)
+    return RADIX_NIL;
 
-    // Key is prefix of at least two other nodes' keys
-    if (tree->left && tree->right) {
-      return tree;
-    }
+  while (depth > 1) {
+    child = stack[--depth];
+    radix_link(pool, stack[depth - 1].tree, stack[depth - 1].bits,
+               child.tree, child.prefix, child.bits);
+  }
+  node = RADIX_NODE(pool, stack[0].tree);
+  node->key = stack[0].prefix;
+  node->bits = stack[0].bits;
+  return stack[0].tree;
+}
 
-    // Only has 1 child, merge with child if it has no value
-    else if (tree->left) {
-      if (!tree->has_value) {
-        tree->left->key = tree->key + (tree->left->key >> tree->bits);
-        tree->left->bits += tree->bits;
-        new_tree = tree->left;
-        free(tree);
-        return new_tree;
-      } else {
-        return tree;
-      }
-    }
-    else if (tree->right) {
-      if (!tree->has_value) {
-        tree->right->key = tree->key + (tree->right->key >> tree->bits);
-        tree->right->bits += tree->bits;
-        new_tree = tree->right;
-        free(tree);
-        return new_tree;
-      } else {
-        return tree;
-      }
-    }
-    // Has no children, delete node if it has no value
-    else {
-      if (!tree->has_value) {
-        free(tree);
-        tree = NULL;
-      }
-      return tree;
-    }
+// Merge a node into its only child, returning the child
+static uint32_t radix_merge_child(radix_pool *pool, uint32_t tree, uint32_t child) {
+  radix_node *node, *child_node;
+
+  RADIX_COUNT(pool, merges, 1);
+  child = radix_writable(pool, child);
+  node = RADIX_NODE(pool, tree);
+  child_node = RADIX_NODE(pool, child);
+  // node's host bits past its prefix would carry into the child's
+  child_node->key = (node->key & PREFIX_MASK(node->bits)) + (child_node->key >> node->bits);
+  child_node->bits += node->bits;
+  radix_release(pool, tree);
+  return child;
+}
+
+/* Removes a node without a value that has fewer than two children,
+ * updating the link that points to it. Returns 0 if the node had to
+ * stay.
+ */
+static int radix_prune(radix_pool *pool, uint32_t *link) {
+  radix_node *node;
+
+  node = RADIX_NODE(pool, *link);
+  if (node->has_value || (node->left && node->right))
+    return 0;
+  if (node->left)
+    *link = radix_merge_child(pool, *link, node->left);
+  else if (node->right)
+    *link = radix_merge_child(pool, *link, node->right);
+  else {
+    radix_release(pool, *link);
+    *link = RADIX_NIL;
   }
+  return 1;
+}
 
-  // This node has the key
-  else if (bits && !bits_rmd) {
+/* Deletes key/bits and returns the new root. The links followed on the
+ * way down are kept on a stack so that the nodes left without a value
+ * can be pruned or merged on the way back up. In copy-on-write mode the
+ * nodes on the way are copied as in radix_insert.
+ */
+uint32_t radix_delete(radix_pool *pool, uint32_t tree, uint8_t bits, uint32_t key) {
+  uint32_t *stack[33], *link;
+  uint8_t bits_match;
+  radix_node *node;
+  int depth;
 
-    // Key is prefix of at least two other keys, cannot delete
-    if (tree->left && tree->right) {
-      tree->has_value = 0;
+  RADIX_COUNT(pool, deletes, 1);
+  depth = 0;
+  link = &tree;
+  for (;;) {
+    if (*link == RADIX_NIL)
       return tree;
-    }
+    *link = radix_writable(pool, *link);
+    node = RADIX_NODE(pool, *link);
+    bits_match = num_prefix_match(node->key, node->bits, key, bits);
 
-    // Only has 1 child, merge nodes and keys
-    else if (tree->left) {
-      tree->left->key = tree->key + (tree->left->key >> tree->bits);
-      tree->left->bits += tree->bits;
-      new_tree = tree->left;
-      free(tree);
-      return new_tree;
-    }
+    // key is not in the tree
+    if (bits_match < node->bits)
+      return tree;
 
-    else if (tree->right) {
-      tree->right->key = tree->key + (tree->right->key >> tree->bits);
-      tree->right->bits += tree->bits;
-      new_tree = tree->right;
-      free(tree);
-      return new_tree;
-    }
+    // This node has the key
+    if (bits_match == bits)
+      break;
 
-    // Has no children, delete node
-    else {
-      free(tree);
-      return NULL;
-    }
+    // This node's key is only a prefix, try to delete in subtree
+    stack[depth++] = link;
+    bits -= bits_match;
+    key <<= bits_match;
+    link = NTH_MSB(key, 1) ? &node->right : &node->left;
   }
+
+  if (!node->has_value)
+    return tree;
+  node->has_value = 0;
+  node->value = 0;
+
+  while (radix_prune(pool, link) && depth > 0)
+    link = stack[--depth];
   return tree;
 }
 
-int radix_prefix_lookup(radix_node *tree, uint8_t bits, uint32_t key, int *value) {
+/* Stores in value the value of the longest prefix of key/bits in the
+ * tree. Single downward walk that remembers the best match so far.
+ */
+int radix_prefix_lookup(radix_pool *pool, uint32_t tree, uint8_t bits, uint32_t key, int *value) {
+  radix_node *node;
   int rc;
-  uint32_t xor;
-  uint32_t shifted;
 
-  if (!tree) {
-    return NOT_FOUND;
-  }
-  xor = (tree->key ^ key);
-  //printf("tree 0x%x\n", tree);
-  //printf("tree->left 0x%x\n", tree->left);
-  //printf("tree %u %u key %u %u xor %u\n", tree->key, tree->bits, key, bits, xor);
+  rc = NOT_FOUND;
+  RADIX_COUNT(pool, lookups, 1);
+  while (tree != RADIX_NIL) {
+    node = RADIX_NODE(pool, tree);
+    RADIX_COUNT(pool, visited, 1);
+
+    // this node is not a prefix
+    if (node->bits > bits || (node->bits && ((node->key ^ key) & LEADING_ONES_32(node->bits))))
+      break;
 
-  // Found exact match
-  if (!xor && tree->bits == bits && tree->value) {
-    *value = tree->value;
-    return FOUND;
+    if (node->has_value) {
+      *value = node->value;
+      rc = FOUND;
+    }
+    bits -= node->bits;
+    if (!bits)
+      break;
+    key <<= node->bits;
+    tree = (key & 0x80000000) ? node->right : node->left;
   }
+  return rc;
+}
+
+/* Looks up n (at most FORWARD_BATCH) 32-bit keys at once, storing the
+ * value of the longest matching prefix of each, or -1, in values. All
+ * walks advance one level per round, and the next node of every walk
+ * is prefetched before any of them is read. The lookups are counted in
+ * counters, which lets threads looking up the same pool keep counters
+ * of their own.
+ */
+void radix_prefix_lookup_batch_counted(radix_pool *pool, radix_counters *counters, uint32_t tree,
+                                       const uint32_t *keys, int *values, int n) {
+  uint32_t node[FORWARD_BATCH];
+  uint32_t key[FORWARD_BATCH];
+  uint8_t depth[FORWARD_BATCH];
+  radix_node *t;
+  int i, active;
+#ifdef ROUTER_STATS
+  uint64_t visited = 0;
+#endif
 
-  // this node is not a prefix
-  else if (xor & LEADING_ONES_32(tree->bits) && tree->bits) {
-    return NOT_FOUND;
+  for (i = 0; i < n; i++) {
+    node[i] = tree;
+    key[i] = keys[i];
+    depth[i] = 0;
+    values[i] = -1;
   }
 
-  // this node's key is a prefix to the search key 
-  else {
-    shifted = key << tree->bits;
-    if (shifted & 0x80000000) {
-      rc = radix_prefix_lookup(tree->right, bits - tree->bits, shifted, value);
-    } else {
-      rc = radix_prefix_lookup(tree->left, bits - tree->bits, shifted, value);
+  active = (tree != RADIX_NIL);
+  while (active) {
+    active = 0;
+    for (i = 0; i < n; i++) {
+      if (node[i] == RADIX_NIL) continue;
+      t = RADIX_NODE(pool, node[i]);
+#ifdef ROUTER_STATS
+      visited++;
+#endif
+
+      // this node is not a prefix
+      if (t->bits && ((t->key ^ key[i]) & LEADING_ONES_32(t->bits))) {
+        node[i] = RADIX_NIL;
+        continue;
+      }
+      if (t->has_value)
+        values[i] = t->value;
+
+      depth[i] += t->bits;
+      if (depth[i] >= 32) {
+        node[i] = RADIX_NIL;
+        continue;
+      }
+      key[i] <<= t->bits;
+      node[i] = (key[i] & 0x80000000) ? t->right : t->left;
+      if (node[i] != RADIX_NIL) {
+        __builtin_prefetch(RADIX_NODE(pool, node[i]));
+        active = 1;
+      }
     }
+  }
+#ifdef ROUTER_STATS
+  counters->lookups += n;
+  counters->visited += visited;
+#endif
+}
+
+void radix_prefix_lookup_batch(radix_pool *pool, uint32_t tree, const uint32_t *keys, int *values, int n) {
+  radix_prefix_lookup_batch_counted(pool, &pool->counters, tree, keys, values, n);
+}
+
+/* Walks the tree counting nodes per depth, and the free list. */
+void radix_tree_stats(radix_pool *pool, uint32_t tree, radix_stats *stats) {
+  struct { uint32_t tree, depth; } stack[68];
+  radix_node *node;
+  uint32_t index, depth;
+  int top;
 
-    if (rc != FOUND && tree->has_value) {
-      *value = tree->value;
-      return FOUND;
+  memset(stats, 0, sizeof(radix_stats));
+  top = 0;
+  if (tree != RADIX_NIL) {
+    stack[0].tree = tree;
+    stack[0].depth = 1;
+    top = 1;
+  }
+  while (top > 0) {
+    top--;
+    node = RADIX_NODE(pool, stack[top].tree);
+    depth = stack[top].depth;
+    stats->nodes++;
+    stats->depth[min(depth, 33U)]++;
+    if (depth > stats->max_depth)
+      stats->max_depth = depth;
+    if (node->has_value) {
+      stats->valued++;
+      stats->valued_depth_sum += depth;
     } else {
-      return rc;
+      stats->internal++;
+    }
+    if (node->right) {
+      stack[top].tree = node->right;
+      stack[top++].depth = depth + 1;
+    }
+    if (node->left) {
+      stack[top].tree = node->left;
+      stack[top++].depth = depth + 1;
     }
   }
+
+  for (index = pool->free_list; index != RADIX_NIL; index = RADIX_NODE(pool, index)->left)
+    stats->free++;
+  stats->bytes_allocated = (size_t) pool->num_slabs * RADIX_SLAB_SIZE * sizeof(radix_node);
+  stats->bytes_used = (size_t) (pool->next - 1 - stats->free) * sizeof(radix_node);
 }
 
 // Return the number of leading bits match
@@ -382,20 +1192,29 @@ uint8_t num_prefix_match(uint32_t key_1, uint8_t bits_1,
   return match;
 }
 
-void traverseTree(radix_node *tree, uint8_t prefix_bits, uint32_t prefix, uint32_t stack) {
+void traverseTree(radix_pool *pool, uint32_t tree, uint8_t prefix_bits, uint32_t prefix, uint32_t stack) {
   uint32_t ip;
+  radix_node *node;
+  char *p;
 
-  if (tree) {
-    ip = prefix + (tree->key >> prefix_bits);
-    traverseTree(tree->right, prefix_bits + tree->bits, ip, stack+1);
+  if (tree != RADIX_NIL) {
+    node = RADIX_NODE(pool, tree);
+    ip = prefix + (node->key >> prefix_bits);
+    traverseTree(pool, node->right, prefix_bits + node->bits, ip, stack+1);
 
-    if (tree->has_value)
-      printf("%*s%u.%u.%u.%u/%u->%d\n", stack, "", (ip >> 24) & 0xFF, (ip >> 16) & 0xFF,
-        (ip >> 8) & 0xFF, ip & 0xFF, prefix_bits + tree->bits, tree->value);
-    else
-      printf("%*s%u.%u.%u.%u/%u\n", stack, "", (ip >> 24) & 0xFF, (ip >> 16) & 0xFF,
-        (ip >> 8) & 0xFF, ip & 0xFF, prefix_bits + tree->bits);
+    p = output_reserve(&out_stdout, OUTPUT_RECORD_MAX);
+    memset(p, ' ', stack);
+    p = format_ip(p + stack, ip);
+    *p++ = '/';
+    p = format_uint(p, prefix_bits + node->bits);
+    if (node->has_value) {
+      *p++ = '-';
+      *p++ = '>';
+      p = format_int(p, node->value);
+    }
+    *p++ = '\n';
+    output_commit(&out_stdout, p);
 
-    traverseTree(tree->left, prefix_bits + tree->bits, ip, stack+1);
+    traverseTree(pool, node->left, prefix_bits + node->bits, ip, stack+1);
   }
 }
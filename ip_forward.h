@@ -17,33 +17,152 @@
 #define NTH_LSB(X,N) ((X>>(N-1))&0x00000001)
 #define NTH_MSB(X,N) ((X<<(N-1))&0x80000000)
 #define TRAILING_ONES_32(X) ((X<sizeof(unsigned)*8) ? ((1U<<X)-1) : (0xFFFFFFFF >> (32-X)))
+#define PREFIX_MASK(X) ((X) ? 0xFFFFFFFFU << (32 - (X)) : 0)
 #define LEADING_ONES_32(X) ((X<0x20) ? (((1U<<X)-1)<<(32-X)) : (0xFFFFFFFF << (32-X)))
 
+/* Number of lookups walked in lockstep by forward_packet_batch. */
+#define FORWARD_BATCH 32
+
 #define FOUND 1
 #define NOT_FOUND 0
 
+/* Children are indices into the radix_pool that owns the node. */
 typedef struct radix_node {
   uint32_t key;
   uint8_t bits, has_value;
   int value;
-  struct radix_node *left, *right;
+  uint32_t left, right;
 } radix_node;
-radix_node* radix_insert(radix_node *tree, uint8_t bits, uint32_t key, int value); 
-radix_node* radix_delete(radix_node *tree, uint8_t bits, uint32_t key);
-int radix_prefix_lookup(radix_node *tree, uint8_t bits, uint32_t key, int *value);
+
+#define RADIX_NIL 0
+#define RADIX_SLAB_BITS 12
+#define RADIX_SLAB_SIZE (1U << RADIX_SLAB_BITS)
+#define RADIX_MAX_SLABS (1U << (32 - RADIX_SLAB_BITS))
+#define RADIX_NODE(pool, index) \
+  (&(pool)->slabs[(index) >> RADIX_SLAB_BITS][(index) & (RADIX_SLAB_SIZE - 1)])
+
+/* Hot-path counters. They only count when compiled with
+ * -DROUTER_STATS (make STATS=1); otherwise RADIX_COUNT is a no-op.
+ */
+typedef struct radix_counters {
+  uint64_t lookups, visited;
+  uint64_t inserts, deletes, splits, merges;
+} radix_counters;
+
+#ifdef ROUTER_STATS
+#define RADIX_COUNT(pool, counter, n) ((pool)->counters.counter += (n))
+#else
+#define RADIX_COUNT(pool, counter, n) ((void) 0)
+#endif
+
+/* A node replaced in copy-on-write mode, and the epoch it was replaced
+ * in. Lookups that started in an earlier epoch may still read it.
+ */
+typedef struct radix_retired {
+  uint32_t node;
+  uint32_t epoch;
+} radix_retired;
+
+/* In copy-on-write mode (cow set), radix_insert and radix_delete never
+ * change a node that is reachable from an earlier root: the nodes on
+ * the path they change are copied, and the originals are retired until
+ * radix_reclaim is told that no lookup can reach them any more. Roots
+ * handed out before an update stay valid for lookups in other threads.
+ */
+typedef struct radix_pool {
+  radix_node **slabs;
+  uint32_t num_slabs;
+  uint32_t next;        // first index never handed out
+  uint32_t free_list;   // deleted nodes, chained through left
+  void *image;          // snapshot mapping holding the first image_slabs slabs
+  size_t image_size;
+  uint32_t image_slabs;
+  uint8_t cow;
+  uint32_t epoch;       // tag of the nodes retired from now on
+  radix_retired *retired;
+  uint32_t retired_head, num_retired, max_retired;
+  radix_counters counters;
+} radix_pool;
+
+/* A prefix and its value, as handed to the bulk loader. */
+typedef struct radix_prefix {
+  uint32_t key;
+  uint8_t bits;
+  int value;
+} radix_prefix;
+
+/* Shape of a tree, gathered by walking it. Depths count nodes, the
+ * root being at depth 1.
+ */
+typedef struct radix_stats {
+  uint32_t nodes, valued, internal, free;
+  uint32_t max_depth;
+  uint64_t valued_depth_sum;
+  uint32_t depth[34];
+  size_t bytes_allocated, bytes_used;
+} radix_stats;
+
+void radix_pool_init(radix_pool *pool);
+void radix_pool_destroy(radix_pool *pool);
+uint32_t radix_node_alloc(radix_pool *pool);
+void radix_node_free(radix_pool *pool, uint32_t index);
+void radix_reclaim(radix_pool *pool, uint32_t epoch);
+
+uint32_t radix_insert(radix_pool *pool, uint32_t tree, uint8_t bits, uint32_t key, int value);
+uint32_t radix_delete(radix_pool *pool, uint32_t tree, uint8_t bits, uint32_t key);
+uint32_t radix_build(radix_pool *pool, const radix_prefix *prefixes, int n);
+int radix_prefix_lookup(radix_pool *pool, uint32_t tree, uint8_t bits, uint32_t key, int *value);
+void radix_prefix_lookup_batch(radix_pool *pool, uint32_t tree, const uint32_t *keys, int *values, int n);
+void radix_prefix_lookup_batch_counted(radix_pool *pool, radix_counters *counters, uint32_t tree,
+                                       const uint32_t *keys, int *values, int n);
+void radix_tree_stats(radix_pool *pool, uint32_t tree, radix_stats *stats);
 uint8_t num_prefix_match(uint32_t key_1, uint8_t bits_1, uint32_t key_2, uint8_t bits_2);
-void traverseTree(radix_node *tree, uint8_t prefix_bits, uint32_t prefix, uint32_t stack);
-void radix_inorder_print(radix_node *tree, uint8_t prefix_bits, uint32_t prefix,
-    void (*fn)(uint32_t, uint8_t, int, FILE*), FILE* out);
+void traverseTree(radix_pool *pool, uint32_t tree, uint8_t prefix_bits, uint32_t prefix, uint32_t stack);
+void radix_inorder_print(radix_pool *pool, uint32_t tree, uint8_t prefix_bits, uint32_t prefix,
+    void (*fn)(uint32_t, uint8_t, int, void*), void *arg);
+radix_prefix* radix_prefixes(radix_pool *pool, uint32_t tree, uint32_t *count);
+uint32_t radix_subtree(radix_pool *pool, uint32_t tree, uint8_t bits, uint32_t key,
+                       uint8_t *prefix_bits, uint32_t *prefix, int *value);
+
+/* Lookup engines. The radix tree is always kept up to date; the
+ * other engines are compiled from it before the next lookup after a
+ * table change.
+ */
+typedef enum forward_engine {
+  ENGINE_RADIX,
+  ENGINE_DIR24_8,
+  ENGINE_TREE_BITMAP,
+  ENGINE_INTERVAL
+} forward_engine;
 
 typedef struct router_state {
-  radix_node *tree;
+  radix_pool pool;
+  uint32_t tree;
+  forward_engine engine;
+  struct dir24_8 *dir;
+  struct tree_bitmap *tbm;
+  struct interval_table *intervals;
+  struct flow_cache *cache;   // NULL unless enabled with set_flow_cache
+  struct ortc *fib;           // aggregated table, NULL unless enabled with set_aggregation
+  uint8_t dirty;
+  uint32_t patched;        // tbl24 slots patched since the last lookup
+  uint8_t simd;            // batch lookups of dir24-8 and interval use AVX2
+  uint8_t binary_output;   // write O records (trace.h) instead of lines
 } *router_state;
 
 router_state initialize_router(void);
+void set_forwarding_engine(router_state state, forward_engine engine);
+void set_simd(router_state state, int enable);
+int set_flow_cache(router_state state, uint32_t entries);
+int set_aggregation(router_state state, int enable);
+void print_flow_cache_stats(router_state state, FILE *output);
 void populate_forwarding_table(router_state *state, uint32_t ip, uint8_t netsize, int nic);
+void load_forwarding_table(router_state *state, radix_prefix *entries, int n);
 void forward_packet(router_state state, uint32_t ip, unsigned int packet_id);
+void forward_packet_batch(router_state state, const uint32_t *ips, const unsigned *ids, int n);
+void lookup_packet_batch(router_state state, const uint32_t *ips, int *nics, int n);
 void print_router_state(router_state state, FILE *output);
+void print_router_stats(router_state state, FILE *output);
 void destroy_router(router_state state);
 
 #endif
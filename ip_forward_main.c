@@ -8,73 +8,530 @@
 #include <string.h>
 #include <strings.h>
 #include <ctype.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
 
 #include "ip_forward.h"
+#include "parallel.h"
+#include "pipeline.h"
+#include "snapshot.h"
+#include "latency.h"
+#include "input.h"
+#include "output.h"
+#include "trace.h"
 
 /* Largest line in the input file. */
 #define MAXLINE 1000
 
+static void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [-e radix|dir24-8|tree-bitmap|interval] [--flow-cache=entries] [--table=file]\n"
+          "       [--load-snapshot=file] [--save-snapshot=file] [--stats-file=file]\n"
+          "       [--latency] [--threads=N] [--pipeline] [--no-simd] [--aggregate] [--binary]\n"
+          "       [--binary-output] [table_output_file]\n", prog);
+}
+
+static int parse_engine(const char *name, forward_engine *engine) {
+  if (!strcmp(name, "radix"))
+    *engine = ENGINE_RADIX;
+  else if (!strcmp(name, "dir24-8"))
+    *engine = ENGINE_DIR24_8;
+  else if (!strcmp(name, "tree-bitmap"))
+    *engine = ENGINE_TREE_BITMAP;
+  else if (!strcmp(name, "interval"))
+    *engine = ENGINE_INTERVAL;
+  else
+    return -1;
+  return 0;
+}
+
+/* Worker threads doing the lookups, if enabled with --threads. */
+static parallel_forward *parallel;
+
+/* Where S records and SIGUSR1 send the router stats. */
+static FILE *stats_output;
+static volatile sig_atomic_t stats_requested;
+
+static void request_stats(int sig) {
+  stats_requested = 1;
+}
+
+static void print_stats(router_state state) {
+  stats_requested = 0;
+  // the lookups of the workers are counted as their jobs are written out
+  if (parallel)
+    parallel_sync(parallel);
+  print_router_stats(state, stats_output);
+  latency_print(stats_output);
+  fflush(stats_output);
+}
+
+/* Output that goes out in input order, after that of the packets
+ * before it.
+ */
+static void write_in_order(const char *data, size_t len) {
+  if (parallel)
+    parallel_write(parallel, data, len);
+  else
+    output_write(&out_stdout, data, len);
+}
+
+/* Packets waiting to be forwarded together. */
+typedef struct packet_batch {
+  uint32_t ips[FORWARD_BATCH];
+  unsigned int ids[FORWARD_BATCH];
+  int count;
+} packet_batch;
+
+/* Forwards the packets collected so far, in input order. */
+static void flush_packets(router_state state, packet_batch *batch) {
+  if (batch->count) {
+    forward_packet_batch(state, batch->ips, batch->ids, batch->count);
+    batch->count = 0;
+  }
+}
+
+static void add_packet(router_state state, packet_batch *batch, uint32_t ip, unsigned int packet_id) {
+  if (parallel) {
+    parallel_packet(parallel, ip, packet_id);
+    return;
+  }
+  batch->ips[batch->count] = ip;
+  batch->ids[batch->count++] = packet_id;
+  if (batch->count == FORWARD_BATCH)
+    flush_packets(state, batch);
+}
+
+/* Table entries read before anything else, loaded in one go by
+ * load_forwarding_table once the first other record shows up.
+ */
+typedef struct table_run {
+  radix_prefix *entries;
+  int count, capacity;
+  int open;
+} table_run;
+
+static void add_table_entry(router_state state, table_run *run, uint32_t ip, uint8_t netsize, int nic) {
+  if (!run->open) {
+    if (parallel)
+      parallel_barrier(parallel);
+    populate_forwarding_table(&state, ip, netsize, nic);
+    return;
+  }
+  if (run->count == run->capacity) {
+    run->capacity = run->capacity ? run->capacity * 2 : 4096;
+    run->entries = (radix_prefix*) realloc(run->entries, run->capacity * sizeof(radix_prefix));
+    if (!run->entries) {
+      perror("Could not allocate forwarding table");
+      exit(EXIT_FAILURE);
+    }
+  }
+  run->entries[run->count].key = ip;
+  run->entries[run->count].bits = netsize;
+  run->entries[run->count++].value = nic;
+}
+
+static void end_table_run(router_state state, table_run *run) {
+  if (!run->open) return;
+  if (parallel)
+    parallel_barrier(parallel);
+  load_forwarding_table(&state, run->entries, run->count);
+  free(run->entries);
+  run->entries = NULL;
+  run->open = 0;
+}
+
+/* Adds the entries of a table file, in the format written by
+ * print_router_state, to the initial run.
+ */
+static int read_table_file(router_state state, table_run *run, const char *filename) {
+  const char *line;
+  size_t len;
+  unsigned int netsize;
+  uint32_t ip;
+  int fd, nic;
+  input in;
+
+  fd = open(filename, O_RDONLY);
+  if (fd < 0 || input_open(&in, fd))
+    return -1;
+  while (input_next_line(&in, MAXLINE, &line, &len)) {
+    if (scan_route(line, len, &ip, &netsize, &nic) < 6)
+      fprintf(stderr, "Invalid table file line: %.*s", (int) len, line);
+    else
+      add_table_entry(state, run, ip, netsize, nic);
+  }
+  input_close(&in);
+  close(fd);
+  return 0;
+}
+
+static void process_text(router_state state, input *in, packet_batch *batch, table_run *run) {
+  const char *line;
+  size_t len;
+  unsigned int netsize, metric, update_id;
+  uint32_t ip;
+  int nic;
+  unsigned int packet_id;
+  trace_record rec;
+  char buf[TRACE_RECORD_MAX];
+
+  while(input_next_line(in, MAXLINE, &line, &len)) {
+    
+    if (toupper(line[0]) != 'T')
+      end_table_run(state, run);
+    if (stats_requested)
+      print_stats(state);
+
+    // Runs of consecutive packets are looked up together
+    if (toupper(line[0]) == 'P' && scan_packet(line, len, &ip, &packet_id) == 5) {
+      add_packet(state, batch, ip, packet_id);
+      continue;
+    }
+    flush_packets(state, batch);
+    
+    if (toupper(line[0]) == 'T') {
+      
+      if (scan_table_entry(line, len, &ip, &netsize, &nic) < 6)
+        fprintf(stderr, "Invalid table entry input: %.*s", (int) len, line);
+      else
+        add_table_entry(state, run, ip, netsize, nic);
+    }
+    else if (toupper(line[0]) == 'P') {
+      
+      fprintf(stderr, "Invalid packet input: %.*s", (int) len, line);
+    }
+    else if (toupper(line[0]) == 'S') {
+      print_stats(state);
+    }
+    else if (toupper(line[0]) == 'A' && !state->binary_output) {
+      
+      // Advertisements are output exactly as they are. This allows piping from part 2.
+      write_in_order(line, len);
+    }
+    else if (toupper(line[0]) == 'A' &&
+             scan_advertisement(line, len, &ip, &netsize, &metric, &update_id) == 7) {
+      
+      memset(&rec, 0, sizeof(rec));
+      rec.type = 'A';
+      rec.ip = ip;
+      rec.netsize = netsize;
+      rec.metric = metric;
+      rec.id = update_id;
+      write_in_order(buf, trace_encode(buf, &rec) - buf);
+    }
+    else {
+      // the tree dump would corrupt a binary output
+      if (!state->binary_output) {
+        // it goes straight out, after the output of the packets before it
+        if (parallel)
+          parallel_sync(parallel);
+        traverseTree(&state->pool, state->tree, 0, 0, 0);
+      }
+      fprintf(stderr, "Invalid input line: %.*s\n", (int) len, line);
+    }
+  }
+}
+
+static void process_binary(router_state state, input *in, packet_batch *batch, table_run *run) {
+  trace_record rec;
+  char buf[OUTPUT_RECORD_MAX];
+  int rc;
+
+  while ((rc = input_next_record(in, &rec)) > 0) {
+    if (rec.type != 'T')
+      end_table_run(state, run);
+    if (stats_requested)
+      print_stats(state);
+
+    if (rec.type == 'P') {
+      add_packet(state, batch, rec.ip, rec.id);
+      continue;
+    }
+    flush_packets(state, batch);
+
+    if (rec.type == 'T') {
+      add_table_entry(state, run, rec.ip, rec.netsize, rec.nic);
+    }
+    else if (rec.type == 'S') {
+      print_stats(state);
+    }
+    else if (rec.type == 'A') {
+      if (state->binary_output)
+        write_in_order(buf, trace_encode(buf, &rec) - buf);
+      else
+        write_in_order(buf, format_trace_record(buf, &rec) - buf);
+    }
+    else {
+      fprintf(stderr, "Invalid input record: %c\n", rec.type);
+    }
+  }
+  if (rc == -1)
+    fprintf(stderr, "Truncated binary trace\n");
+  else if (rc < 0)
+    fprintf(stderr, "Invalid record in binary trace\n");
+}
+
+// Look up count packet records in a row
+static void lookup_records(router_state state, pipeline_record *records, int count) {
+  uint32_t ips[FORWARD_BATCH];
+  int nics[FORWARD_BATCH];
+  int i;
+
+  for (i = 0; i < count; i++)
+    ips[i] = records[i].rec.ip;
+  lookup_packet_batch(state, ips, nics, count);
+  for (i = 0; i < count; i++)
+    records[i].rec.nic = nics[i];
+}
+
+/* Lookup stage of --pipeline: applies the records of each batch in
+ * input order. Table entries end a run of packets, so packets are
+ * looked up against the table as of their place in the input.
+ */
+static void process_pipeline(router_state state, pipeline *pl, table_run *run) {
+  pipeline_batch *batch;
+  pipeline_record *r;
+  int i, first = 0, count, dump;
+
+  while ((batch = pipeline_next(pl))) {
+    for (i = 0, count = 0; i < batch->count; i++) {
+      r = &batch->records[i];
+      if (r->rec.type != 'T')
+        end_table_run(state, run);
+      if (stats_requested)
+        print_stats(state);
+
+      if (r->rec.type == 'P' && !r->error) {
+        if (!count)
+          first = i;
+        if (++count == FORWARD_BATCH) {
+          lookup_records(state, batch->records + first, count);
+          count = 0;
+        }
+        continue;
+      }
+      if (count) {
+        lookup_records(state, batch->records + first, count);
+        count = 0;
+      }
+
+      if (r->error)
+        fprintf(stderr, r->error, (int) r->len, batch->text + r->text);
+      else if (r->rec.type == 'T')
+        add_table_entry(state, run, r->rec.ip, r->rec.netsize, r->rec.nic);
+      else if (r->rec.type == 'S')
+        print_stats(state);
+    }
+    if (count)
+      lookup_records(state, batch->records + first, count);
+    // the batch belongs to the writer once passed on
+    dump = batch->count && batch->records[batch->count - 1].dump_tree;
+    pipeline_pass(pl, batch);
+
+    // an invalid line shows the tree, after the output before it
+    if (dump) {
+      pipeline_sync(pl);
+      traverseTree(&state->pool, state->tree, 0, 0, 0);
+    }
+  }
+}
+
 int main(int argc, char *argv[]) {
   
+  static const struct option options[] = {
+    { "engine", required_argument, NULL, 'e' },
+    { "binary", no_argument, NULL, 'b' },
+    { "binary-output", no_argument, NULL, 'B' },
+    { "flow-cache", required_argument, NULL, 'c' },
+    { "table", required_argument, NULL, 't' },
+    { "load-snapshot", required_argument, NULL, 'l' },
+    { "save-snapshot", required_argument, NULL, 's' },
+    { "stats-file", required_argument, NULL, 'S' },
+    { "latency", no_argument, NULL, 'L' },
+    { "threads", required_argument, NULL, 'j' },
+    { "pipeline", no_argument, NULL, 'p' },
+    { "no-simd", no_argument, NULL, 'V' },
+    { "aggregate", no_argument, NULL, 'a' },
+    { NULL, 0, NULL, 0 }
+  };
+
   FILE *ft_output;
   char *filename;
-  char line[MAXLINE];
-  unsigned int netsize;
-  unsigned int ip[4];
-  int nic;
-  unsigned int packet_id;
+  input in;
+  packet_batch batch;
+  table_run run;
   router_state state;
+  forward_engine engine = ENGINE_RADIX;
+  int binary_input = 0, binary_output = 0, pipelined = 0, simd = 1, aggregate = 0;
+  pipeline *pl = NULL;
+  unsigned long cache_entries = 0, num_threads = 0;
+  char *end, *table_file = NULL;
+  char *load_snapshot = NULL, *save_snapshot = NULL;
+  int opt, rc;
+  
+  while ((opt = getopt_long(argc, argv, "e:bBc:t:l:s:S:Lj:pa", options, NULL)) != -1) {
+    switch (opt) {
+    case 'b':
+      binary_input = 1;
+      break;
+    case 'B':
+      binary_output = 1;
+      break;
+    case 'c':
+      cache_entries = strtoul(optarg, &end, 10);
+      if (*end || cache_entries > (1UL << 26)) {
+        fprintf(stderr, "Invalid flow cache size: %s\n", optarg);
+        usage(argv[0]);
+        return 2;
+      }
+      break;
+    case 'j':
+      num_threads = strtoul(optarg, &end, 10);
+      if (*end || num_threads > 1024) {
+        fprintf(stderr, "Invalid number of threads: %s\n", optarg);
+        usage(argv[0]);
+        return 2;
+      }
+      break;
+    case 'p':
+      pipelined = 1;
+      break;
+    case 'V':
+      simd = 0;
+      break;
+    case 'a':
+      aggregate = 1;
+      break;
+    case 't':
+      table_file = optarg;
+      break;
+    case 'l':
+      load_snapshot = optarg;
+      break;
+    case 's':
+      save_snapshot = optarg;
+      break;
+    case 'L':
+      latency_enable();
+      break;
+    case 'S':
+      stats_output = fopen(optarg, "a");
+      if (!stats_output) {
+        perror("Could not open stats file");
+        return 2;
+      }
+      break;
+    case 'e':
+      if (parse_engine(optarg, &engine)) {
+        fprintf(stderr, "Unknown lookup engine: %s\n", optarg);
+        usage(argv[0]);
+        return 2;
+      }
+      break;
+    default:
+      usage(argv[0]);
+      return 2;
+    }
+  }
   
-  if (argc == 1) {
+  if (optind == argc) {
     filename = "fwd_table.txt";
   }
   else {
-    filename = argv[1];
+    filename = argv[optind];
     if (!strcmp(filename, "-"))
       filename = "/dev/stdout";
   }
   
+  if (num_threads && (engine != ENGINE_RADIX || cache_entries || aggregate)) {
+    fprintf(stderr, "Threads only work with the radix engine, no flow cache and no aggregation\n");
+    return 2;
+  }
+  if (num_threads && pipelined) {
+    fprintf(stderr, "Threads and the pipeline can't be used together\n");
+    return 2;
+  }
+  if (!stats_output)
+    stats_output = stderr;
+  signal(SIGUSR1, request_stats);
+
   ft_output = fopen(filename, "w");
   if (!ft_output) {
     perror("Could not open file for writing");
     return 2;
   }
  
+  if (input_open(&in, STDIN_FILENO)) {
+    perror("Could not read input");
+    return 2;
+  }
+  if (binary_input && input_read_trace_header(&in)) {
+    fprintf(stderr, "Input is not a binary trace\n");
+    return 2;
+  }
+ 
   state = initialize_router();
+  set_forwarding_engine(state, engine);
+  set_simd(state, simd);
+  if (set_aggregation(state, aggregate)) {
+    perror("Could not set up aggregation");
+    return 2;
+  }
+  if (set_flow_cache(state, cache_entries)) {
+    perror("Could not allocate the flow cache");
+    return 2;
+  }
+  state->binary_output = binary_output;
+  if (binary_output)
+    trace_write_header(&out_stdout);
+  if (load_snapshot && (rc = load_router_snapshot(state, load_snapshot))) {
+    if (rc == -1)
+      perror("Could not load snapshot");
+    else
+      fprintf(stderr, "Invalid snapshot file: %s\n", load_snapshot);
+    return 2;
+  }
+  batch.count = 0;
+  memset(&run, 0, sizeof(run));
+  run.open = 1;
+  if (table_file && read_table_file(state, &run, table_file)) {
+    perror("Could not read table file");
+    return 2;
+  }
+  if (num_threads && !(parallel = parallel_start(state, num_threads))) {
+    perror("Could not start threads");
+    return 2;
+  }
+  if (pipelined && !(pl = pipeline_start(&in, MAXLINE, binary_input, binary_output))) {
+    perror("Could not start the pipeline");
+    return 2;
+  }
   
-  while(fgets(line, MAXLINE, stdin)) {
-    
-    if (toupper(line[0]) == 'T') {
-      
-      if (sscanf(line, "T %u.%u.%u.%u/%u %d",
-                 &ip[0], &ip[1], &ip[2], &ip[3], &netsize, &nic) < 6)
-        fprintf(stderr, "Invalid table entry input: %s", line);
-      else
-        populate_forwarding_table(&state, ip[0] << 24 | ip[1] << 16 | ip[2] << 8 | ip[3], netsize, nic);
-    }
-    else if (toupper(line[0]) == 'P') {
-      
-      if (sscanf(line, "P %u.%u.%u.%u %u",
-                 &ip[0], &ip[1], &ip[2], &ip[3], &packet_id) < 5)
-        fprintf(stderr, "Invalid packet input: %s", line);
-      else
-        forward_packet(state, ip[0] << 24 | ip[1] << 16 | ip[2] << 8 | ip[3], packet_id);
-    }
-    else if (toupper(line[0]) == 'A') {
-      
-      // Advertisements are output exactly as they are. This allows piping from part 2.
-      printf("%s", line);
-    }
-    else {
-      traverseTree(state->tree, 0, 0, 0);
-      fprintf(stderr, "Invalid input line: %s\n", line);
-    }
+  if (pl) {
+    process_pipeline(state, pl, &run);
+    pipeline_finish(pl);
   }
+  else if (binary_input)
+    process_binary(state, &in, &batch, &run);
+  else
+    process_text(state, &in, &batch, &run);
+  end_table_run(state, &run);
+  flush_packets(state, &batch);
+  if (parallel)
+    parallel_finish(parallel);
+  input_close(&in);
   
   print_router_state(state, ft_output);
+  print_flow_cache_stats(state, stderr);
+  latency_print(stderr);
+  if (save_snapshot && save_router_snapshot(state, save_snapshot))
+    perror("Could not save snapshot");
   destroy_router(state);
   
   fclose(ft_output);
+  output_flush(&out_stdout);
   
   return EXIT_SUCCESS;
 }
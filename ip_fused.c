@@ -0,0 +1,311 @@
+/*
+ *  ip_fused.c
+ *  Author:
+ *
+ *  ip_route and ip_forward in one process: the same output as
+ *  ip_route | ip_forward, but forwarding NIC changes go straight from
+ *  the routing table to the forwarding table instead of through T
+ *  lines, and packets are looked up without being printed and parsed
+ *  again in between.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <signal.h>
+
+/* ip_route is linked in as ip_route_fused.o, compiled with its entry
+ * points renamed (see ROUTE_RENAMES in the Makefile) so that they do
+ * not clash with ip_forward's.
+ */
+#define router_state route_state
+#define initialize_router initialize_route_state
+#define destroy_router destroy_route_state
+#include "ip_route.h"
+#undef router_state
+#undef initialize_router
+#undef destroy_router
+
+#include "ip_forward.h"
+#include "latency.h"
+#include "input.h"
+#include "output.h"
+#include "trace.h"
+
+/* Largest line in the input file. */
+#define MAXLINE 1000
+
+static void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [-e radix|dir24-8|tree-bitmap|interval] [--flow-cache=entries] [--nics=N]\n"
+          "       [--latency] [--no-simd] [--aggregate] [--binary] [--binary-output] [table_output_file]\n", prog);
+}
+
+/* Set by SIGUSR1 to dump the latency histograms. */
+static volatile sig_atomic_t latency_requested;
+
+static void request_latency(int sig) {
+  latency_requested = 1;
+}
+
+static void print_latency(void) {
+  latency_requested = 0;
+  latency_print(stderr);
+}
+
+/* The forwarding half, and the packets waiting to be forwarded
+ * together.
+ */
+typedef struct fused_state {
+  router_state forward;
+  uint32_t ips[FORWARD_BATCH];
+  unsigned int ids[FORWARD_BATCH];
+  int count;
+} fused_state;
+
+/* Forwards the packets collected so far, in input order. */
+static void flush_packets(fused_state *fused) {
+  if (fused->count) {
+    forward_packet_batch(fused->forward, fused->ips, fused->ids, fused->count);
+    fused->count = 0;
+  }
+}
+
+static void add_packet(fused_state *fused, uint32_t ip, unsigned int packet_id) {
+  fused->ips[fused->count] = ip;
+  fused->ids[fused->count++] = packet_id;
+  if (fused->count == FORWARD_BATCH)
+    flush_packets(fused);
+}
+
+/* Advertiser of the routing half: the packets before the advertisement
+ * go out first, then the A line (what ip_forward echoes of it), and
+ * the T line that would follow becomes a forwarding table update.
+ */
+static void advertise_route(void *arg, uint32_t ip, uint8_t netsize, int nic,
+                            unsigned int metric, unsigned int update_id) {
+  fused_state *fused = (fused_state*) arg;
+  trace_record rec;
+  char *p;
+
+  flush_packets(fused);
+  memset(&rec, 0, sizeof(rec));
+  rec.type = 'A';
+  rec.ip = ip;
+  rec.netsize = netsize;
+  rec.metric = metric;
+  rec.id = update_id;
+  if (fused->forward->binary_output) {
+    trace_write_record(&out_stdout, &rec);
+  } else {
+    p = output_reserve(&out_stdout, OUTPUT_RECORD_MAX);
+    output_commit(&out_stdout, format_trace_record(p, &rec));
+  }
+  populate_forwarding_table(&fused->forward, ip, netsize, nic);
+}
+
+static void process_text(route_state route, fused_state *fused, input *in) {
+  const char *line;
+  size_t len;
+  unsigned int netsize, metric, update_id, packet_id;
+  uint32_t ip;
+  int nic;
+
+  while (input_next_line(in, MAXLINE, &line, &len)) {
+
+    if (latency_requested)
+      print_latency();
+
+    if (toupper(line[0]) == 'U') {
+
+      if (scan_update(line, len, &ip, &netsize, &nic, &metric, &update_id) < 6)
+        fprintf(stderr, "Invalid table entry input: %.*s", (int) len, line);
+      else if (process_update(&route, ip, netsize, nic, metric, update_id))
+        fprintf(stderr, "Invalid NIC in update: %.*s", (int) len, line);
+    }
+    else if (toupper(line[0]) == 'P') {
+
+      // Runs of consecutive packets are looked up together
+      if (scan_packet(line, len, &ip, &packet_id) == 5) {
+        add_packet(fused, ip, packet_id);
+      } else {
+        flush_packets(fused);
+        fprintf(stderr, "Invalid packet input: %.*s", (int) len, line);
+      }
+    }
+    else {
+
+      fprintf(stderr, "Invalid input line: %.*s\n", (int) len, line);
+    }
+  }
+}
+
+static void process_binary(route_state route, fused_state *fused, input *in) {
+  trace_record rec;
+  int rc;
+
+  while ((rc = input_next_record(in, &rec)) > 0) {
+    if (latency_requested)
+      print_latency();
+    if (rec.type == 'U') {
+      if (process_update(&route, rec.ip, rec.netsize, rec.nic, rec.metric, rec.id))
+        fprintf(stderr, "Invalid NIC in update %u: %d\n", rec.id, rec.nic);
+    }
+    else if (rec.type == 'P') {
+      add_packet(fused, rec.ip, rec.id);
+    }
+    else {
+      fprintf(stderr, "Invalid input record: %c\n", rec.type);
+    }
+  }
+  if (rc == -1)
+    fprintf(stderr, "Truncated binary trace\n");
+  else if (rc < 0)
+    fprintf(stderr, "Invalid record in binary trace\n");
+}
+
+int main(int argc, char *argv[]) {
+
+  static const struct option options[] = {
+    { "engine", required_argument, NULL, 'e' },
+    { "binary", no_argument, NULL, 'b' },
+    { "binary-output", no_argument, NULL, 'B' },
+    { "flow-cache", required_argument, NULL, 'c' },
+    { "nics", required_argument, NULL, 'n' },
+    { "latency", no_argument, NULL, 'L' },
+    { "no-simd", no_argument, NULL, 'V' },
+    { "aggregate", no_argument, NULL, 'a' },
+    { NULL, 0, NULL, 0 }
+  };
+
+  FILE *ft_output;
+  char *filename;
+  input in;
+  fused_state fused;
+  route_state route;
+  forward_engine engine = ENGINE_RADIX;
+  int binary_input = 0, binary_output = 0, simd = 1, aggregate = 0;
+  int num_nics = NUM_NICS;
+  unsigned long cache_entries = 0;
+  char *end;
+  int opt;
+
+  while ((opt = getopt_long(argc, argv, "e:bBc:n:La", options, NULL)) != -1) {
+    switch (opt) {
+    case 'b':
+      binary_input = 1;
+      break;
+    case 'B':
+      binary_output = 1;
+      break;
+    case 'c':
+      cache_entries = strtoul(optarg, &end, 10);
+      if (*end || cache_entries > (1UL << 26)) {
+        fprintf(stderr, "Invalid flow cache size: %s\n", optarg);
+        usage(argv[0]);
+        return 2;
+      }
+      break;
+    case 'n':
+      num_nics = atoi(optarg);
+      if (num_nics < 1 || num_nics > MAX_NICS) {
+        fprintf(stderr, "Number of NICs must be between 1 and %d\n", MAX_NICS);
+        return 2;
+      }
+      break;
+    case 'L':
+      latency_enable();
+      break;
+    case 'V':
+      simd = 0;
+      break;
+    case 'a':
+      aggregate = 1;
+      break;
+    case 'e':
+      if (!strcmp(optarg, "radix"))
+        engine = ENGINE_RADIX;
+      else if (!strcmp(optarg, "dir24-8"))
+        engine = ENGINE_DIR24_8;
+      else if (!strcmp(optarg, "tree-bitmap"))
+        engine = ENGINE_TREE_BITMAP;
+      else if (!strcmp(optarg, "interval"))
+        engine = ENGINE_INTERVAL;
+      else {
+        fprintf(stderr, "Unknown lookup engine: %s\n", optarg);
+        usage(argv[0]);
+        return 2;
+      }
+      break;
+    default:
+      usage(argv[0]);
+      return 2;
+    }
+  }
+
+  if (optind == argc) {
+    filename = "fwd_table.txt";
+  }
+  else {
+    filename = argv[optind];
+    if (!strcmp(filename, "-"))
+      filename = "/dev/stdout";
+  }
+
+  ft_output = fopen(filename, "w");
+  if (!ft_output) {
+    perror("Could not open file for writing");
+    return 2;
+  }
+
+  if (input_open(&in, STDIN_FILENO)) {
+    perror("Could not read input");
+    return 2;
+  }
+  if (binary_input && input_read_trace_header(&in)) {
+    fprintf(stderr, "Input is not a binary trace\n");
+    return 2;
+  }
+
+  fused.forward = initialize_router();
+  fused.count = 0;
+  set_forwarding_engine(fused.forward, engine);
+  set_simd(fused.forward, simd);
+  if (set_aggregation(fused.forward, aggregate)) {
+    perror("Could not set up aggregation");
+    return 2;
+  }
+  if (set_flow_cache(fused.forward, cache_entries)) {
+    perror("Could not allocate the flow cache");
+    return 2;
+  }
+  fused.forward->binary_output = binary_output;
+  if (binary_output)
+    trace_write_header(&out_stdout);
+
+  route = initialize_route_state();
+  set_num_nics(route, num_nics);
+  set_route_advertiser(route, advertise_route, &fused);
+  signal(SIGUSR1, request_latency);
+
+  if (binary_input)
+    process_binary(route, &fused, &in);
+  else
+    process_text(route, &fused, &in);
+  flush_packets(&fused);
+  input_close(&in);
+
+  print_router_state(fused.forward, ft_output);
+  print_flow_cache_stats(fused.forward, stderr);
+  latency_print(stderr);
+  destroy_route_state(route);
+  destroy_router(fused.forward);
+
+  fclose(ft_output);
+  output_flush(&out_stdout);
+
+  return EXIT_SUCCESS;
+}
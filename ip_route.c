@@ -7,38 +7,88 @@
 #include <stdlib.h>
 
 #include "ip_route.h"
+#include "output.h"
+#include "latency.h"
 
-static inline void print_advertisement(uint32_t ip, uint8_t netsize, int nic,
-                                       unsigned int metric, unsigned int update_id) {
-  printf("A %u.%u.%u.%u/%u %u %u\n"
-         "T %u.%u.%u.%u/%u %d\n",
-         (ip >> 24) & 0xFF, (ip >> 16) & 0xFF, (ip >> 8) & 0xFF, ip & 0xFF, netsize, metric, update_id,
-         (ip >> 24) & 0xFF, (ip >> 16) & 0xFF, (ip >> 8) & 0xFF, ip & 0xFF, netsize, nic);
+static uint32_t vector_table_alloc(vector_pool *pool);
+static void vector_table_free(vector_pool *pool, uint32_t index);
+
+/* Writes the advertisement of a new route to ip/netsize, followed by
+ * the table entry for part 1.
+ */
+void print_advertisement(uint32_t ip, uint8_t netsize, int nic,
+                         unsigned int metric, unsigned int update_id) {
+  char *p = output_reserve(&out_stdout, OUTPUT_RECORD_MAX);
+
+  *p++ = 'A';
+  *p++ = ' ';
+  p = format_ip(p, ip);
+  *p++ = '/';
+  p = format_uint(p, netsize);
+  *p++ = ' ';
+  p = format_uint(p, metric);
+  *p++ = ' ';
+  p = format_uint(p, update_id);
+  *p++ = '\n';
+  *p++ = 'T';
+  *p++ = ' ';
+  p = format_ip(p, ip);
+  *p++ = '/';
+  p = format_uint(p, netsize);
+  *p++ = ' ';
+  p = format_int(p, nic);
+  *p++ = '\n';
+  output_commit(&out_stdout, p);
 }
 
 /* This function initializes the state of the router.
  */
 router_state initialize_router(void) {
   router_state state = malloc(sizeof(struct router_state));
-  state->map = NULL;
+  state->num_nics = NUM_NICS;
+  state->advertise = NULL;
+  state->advertise_arg = NULL;
+  map_init(&state->map, state->num_nics);
   return state;
 }
 
-void init_vector_table(vector_table *table) {
+/* Sets the number of NICs of the router, which must not have any
+ * subnet yet. Returns -1 if the number is out of range or the router
+ * already has routes.
+ */
+int set_num_nics(router_state state, int num_nics) {
+  if (num_nics < 1 || num_nics > MAX_NICS || state->map.count)
+    return -1;
+  map_destroy(&state->map);
+  state->num_nics = num_nics;
+  map_init(&state->map, num_nics);
+  return 0;
+}
+
+/* Hands the advertisements of the router to advertise instead of
+ * printing them (NULL goes back to printing).
+ */
+void set_route_advertiser(router_state state, route_advertiser advertise, void *arg) {
+  state->advertise = advertise;
+  state->advertise_arg = arg;
+}
+
+void init_vector_table(vector_table *table, int num_nics) {
   int i;
 
-  for (i = 0; i < NUM_NICS; i++) {
+  for (i = 0; i < num_nics; i++) {
     table->dist[i] = METRIC_UNREACHABLE; 
   }
+  table->reachable = 0;
 }
 
-// update the forwarding NIC in table and return NIC
-int update_forwarding_nic(vector_table *table) {
+// Find the forwarding NIC of table from scratch and return it
+static int rescan_forwarding_nic(vector_table *table, int num_nics) {
   int i, nic, min_dist;
  
   nic = -1; 
   min_dist = METRIC_UNREACHABLE;
-  for (i = 0; i < NUM_NICS; i++) {
+  for (i = 0; i < num_nics; i++) {
     if (table->dist[i] < min_dist) {
       min_dist = table->dist[i];
       nic = table->forward_nic = i;
@@ -47,6 +97,124 @@ int update_forwarding_nic(vector_table *table) {
   return nic;
 }
 
+/* Set the distance through nic to dist, update the forwarding NIC in
+ * table and return it (-1 if no NIC reaches the subnet). Only a worse
+ * distance through the forwarding NIC itself needs a rescan of the
+ * vector; any other change can at most make nic the new forwarding
+ * NIC.
+ */
+static int update_forwarding_nic(vector_table *table, int num_nics, int nic, int dist) {
+  int best = table->forward_nic;
+  int best_dist = table->dist[best];
+
+  table->reachable += (dist < METRIC_UNREACHABLE) - (table->dist[nic] < METRIC_UNREACHABLE);
+  table->dist[nic] = dist;
+  if (nic == best)
+    return (dist <= best_dist) ? best : rescan_forwarding_nic(table, num_nics);
+  if (dist < best_dist || (dist == best_dist && nic < best))
+    table->forward_nic = nic;
+  return table->forward_nic;
+}
+
+// Forwarding NIC of a subnet, and the distance through it
+static inline int forwarding_route(const map *m, const map_entry *entry, int *dist) {
+  const vector_table *table;
+
+  if (entry->routes == VECTOR_DENSE) {
+    table = VECTOR_TABLE(&m->pool, entry->table);
+    *dist = table->dist[table->forward_nic];
+    return table->forward_nic;
+  }
+  *dist = entry->route[0].dist;
+  return entry->route[0].nic;
+}
+
+// Move the inline routes of entry, and nic, to a new vector table
+static int make_dense(map *m, map_entry *entry, int num_nics, int n, int nic, int dist) {
+  uint32_t index = vector_table_alloc(&m->pool);
+  vector_table *table = VECTOR_TABLE(&m->pool, index);
+  int i;
+
+  init_vector_table(table, num_nics);
+  table->forward_nic = entry->route[0].nic;
+  for (i = 0; i < n; i++)
+    table->dist[entry->route[i].nic] = entry->route[i].dist;
+  table->reachable = n;
+  entry->routes = VECTOR_DENSE;
+  entry->table = index;
+  return update_forwarding_nic(table, num_nics, nic, dist);
+}
+
+// Move the routes of a vector table back into entry, forwarding route first
+static void make_sparse(map *m, map_entry *entry, int num_nics) {
+  uint32_t index = entry->table;
+  vector_table *table = VECTOR_TABLE(&m->pool, index);
+  int i, n = 1;
+
+  entry->route[0].nic = table->forward_nic;
+  entry->route[0].dist = table->dist[table->forward_nic];
+  for (i = 0; i < num_nics; i++) {
+    if (table->dist[i] < METRIC_UNREACHABLE && i != table->forward_nic) {
+      entry->route[n].nic = i;
+      entry->route[n++].dist = table->dist[i];
+    }
+  }
+  entry->routes = n;
+  vector_table_free(&m->pool, index);
+}
+
+/* Set the distance through nic to dist in the inline routes of entry
+ * and return the new forwarding NIC (-1 if no NIC reaches the subnet,
+ * leaving entry for the caller to delete).
+ */
+static int update_sparse_vector(map *m, map_entry *entry, int num_nics, int nic, int dist) {
+  vector_route *route = entry->route;
+  vector_route tmp;
+  int i, n, best;
+
+  /* Drop the old route through nic. A new subnet announced with an
+   * unreachable distance is left with that route alone, so it goes
+   * too.
+   */
+  for (i = n = 0; i < entry->routes; i++)
+    if (route[i].nic != nic && route[i].dist < METRIC_UNREACHABLE)
+      route[n++] = route[i];
+  if (dist < METRIC_UNREACHABLE) {
+    if (n == VECTOR_INLINE)
+      return make_dense(m, entry, num_nics, n, nic, dist);
+    route[n].nic = nic;
+    route[n++].dist = dist;
+  }
+  if (!n)
+    return -1;
+  entry->routes = n;
+
+  for (i = 1, best = 0; i < n; i++)
+    if (route[i].dist < route[best].dist ||
+        (route[i].dist == route[best].dist && route[i].nic < route[best].nic))
+      best = i;
+  tmp = route[0];
+  route[0] = route[best];
+  route[best] = tmp;
+  return route[0].nic;
+}
+
+/* Set the distance through nic to dist in the vector of entry and
+ * return the new forwarding NIC (-1 if no NIC reaches the subnet).
+ */
+static int update_vector(map *m, map_entry *entry, int num_nics, int nic, int dist) {
+  vector_table *table;
+  int best;
+
+  if (entry->routes != VECTOR_DENSE)
+    return update_sparse_vector(m, entry, num_nics, nic, dist);
+  table = VECTOR_TABLE(&m->pool, entry->table);
+  best = update_forwarding_nic(table, num_nics, nic, dist);
+  if (best != -1 && table->reachable <= VECTOR_INLINE / 2)
+    make_sparse(m, entry, num_nics);
+  return best;
+}
+
 /* This function is called for every line corresponding to a routing
  * update. The IP is represented as a 32-bit unsigned integer. The
  * netsize parameter corresponds to the size of the prefix
@@ -54,43 +222,48 @@ int update_forwarding_nic(vector_table *table) {
  * corresponds to the value informed by the neighboring router, and
  * does not include the cost to reach that router (which is assumed to
  * be always one). If the update triggers an advertisement, this
- * function prints the advertisement in the standard output.
+ * function prints the advertisement in the standard output (or hands
+ * it to the router's advertiser). Returns -1, ignoring the update, if
+ * nic is not one of the router's NICs.
  */
-void process_update(router_state *state, uint32_t ip, uint8_t netsize,
-		    int nic, unsigned int metric, unsigned int update_id) {
+int process_update(router_state *state, uint32_t ip, uint8_t netsize,
+		   int nic, unsigned int metric, unsigned int update_id) {
   subnet net;
-  vector_table *table;
-  map **m;
+  map_entry *entry;
+  map *m;
   int ad, old_fw_nic, new_fw_nic, old_fw_metric, new_fw_metric ;
+  uint64_t start;
 
-  m = &((*state)->map);
+  if (nic < 0 || nic >= (*state)->num_nics)
+    return -1;
+  start = latency_start();
+  m = &(*state)->map;
   net.address = ip;
   net.size = netsize;
-  table = map_lookup(*m, net);
+  entry = map_lookup(m, net);
   ad = 0;
 
-  if (!table && metric != METRIC_UNREACHABLE) {
+  if (!entry && metric != METRIC_UNREACHABLE) {
     // new subnet, need to advertise
     ad = 1;
-    table = (vector_table*) malloc(sizeof(vector_table));
-    init_vector_table(table);
-    new_fw_nic = table->forward_nic = nic;
-    new_fw_metric = table->dist[nic] = metric + 1;
-    *m = map_insert(*m, net, table);
-
-  } else if (table) {
-    old_fw_nic = table->forward_nic;
-    old_fw_metric = table->dist[table->forward_nic];
+    entry = map_insert(m, net);
+    entry->routes = 1;
+    entry->route[0].nic = new_fw_nic = nic;
+    entry->route[0].dist = min(metric + 1, (unsigned int) METRIC_UNREACHABLE);
+    new_fw_metric = metric + 1;
 
-    table->dist[nic] = min(metric + 1, (unsigned int) METRIC_UNREACHABLE);
-    new_fw_nic = update_forwarding_nic(table);
-    new_fw_metric = table->dist[new_fw_nic];
+  } else if (entry) {
+    old_fw_nic = forwarding_route(m, entry, &old_fw_metric);
+    new_fw_nic = update_vector(m, entry, (*state)->num_nics, nic,
+                               min(metric + 1, (unsigned int) METRIC_UNREACHABLE));
+    if (new_fw_nic != -1)
+      forwarding_route(m, entry, &new_fw_metric);
 
     if (new_fw_nic == -1) {
       // unreachable need to be deleted, need to advertise with advertise
       ad = 1;
-      *m = map_delete(*m, net);
-      table = NULL;
+      map_delete(m, net);
+      entry = NULL;
       new_fw_metric = METRIC_UNREACHABLE;
     } else if (old_fw_nic != new_fw_nic) {
       // forwarding NIC was updated to a different NIC, need to advertise
@@ -103,18 +276,14 @@ void process_update(router_state *state, uint32_t ip, uint8_t netsize,
     // originally unreachable, still unreachable. NO ONE CARES
   }
 
-  if (ad) {
+  if (ad && (*state)->advertise) {
+    (*state)->advertise((*state)->advertise_arg, ip, netsize, new_fw_nic, new_fw_metric, update_id);
+  } else if (ad) {
     print_advertisement(ip, netsize, new_fw_nic, new_fw_metric, update_id);
   }
-  // traverse(*m, 0);
-}
-
-void free_map(map* m) {
-  if (!m) return;
-  free_map(m->left);
-  free_map(m->right);
-  free(m->table);
-  free(m);
+  latency_record(LATENCY_ROUTE_UPDATE, start, 1);
+  // traverse(m);
+  return 0;
 }
 
 /* Destroys all memory dynamically allocated through this state (such
@@ -122,96 +291,191 @@ void free_map(map* m) {
  * router.
  */
 void destroy_router(router_state state) {
-  free_map(state->map);
-  state->map = NULL;
+  map_destroy(&state->map);
 }
 
-void traverse(map* m, int depth) {
-  uint32_t ip;
-  if (!m) return;
-  traverse(m->right, depth + 1);
-  ip = m->net.address;
-  printf("%*s%u.%u.%u.%u/%u -> %d\n",
-    depth, "", (ip >> 24) & 0xFF, (ip >> 16) & 0xFF, (ip >> 8) & 0xFF, ip & 0xFF, m->net.size, 
-    m->table->forward_nic);
-  traverse(m->right, depth + 1);
+// Print every subnet with its forwarding NIC, in slot order
+void traverse(map *m) {
+  uint32_t i, ip;
+
+  int dist;
+
+  for (i = 0; i <= m->mask; i++) {
+    if (!m->slots[i].routes) continue;
+    ip = m->slots[i].address;
+    printf("%u.%u.%u.%u/%u -> %d\n", (ip >> 24) & 0xFF, (ip >> 16) & 0xFF, (ip >> 8) & 0xFF,
+           ip & 0xFF, m->slots[i].size, forwarding_route(m, &m->slots[i], &dist));
+  }
 }
 
 int subnet_cmp(subnet net_1, subnet net_2) {
   if (net_1.address == net_2.address) {
     return net_1.size - net_2.size;
   }
-  return net_1.address - net_2.address;
+  return (net_1.address < net_2.address) ? -1 : 1;
 }
 
-map* map_insert(map *m, subnet net, vector_table *table) {
-  int cmp;
 
-  if (m == NULL) {
-    m = (map*) malloc(sizeof(map));
-    m->net = net;
-    m->table = table;
-    m->left = m->right = NULL;
-    return m;
+/******************************************************************************
+ *  Subnet map
+ *****************************************************************************/
+
+#define MAP_MIN_SLOTS 1024
+
+static void vector_pool_init(vector_pool *pool, int num_nics) {
+  pool->slabs = NULL;
+  pool->table_size = (sizeof(vector_table) + num_nics * sizeof(uint16_t) + 3) & ~(size_t) 3;
+  pool->num_slabs = pool->max_slabs = 0;
+  pool->next = 1;
+  pool->free_list = 0;
+}
+
+static void vector_pool_destroy(vector_pool *pool) {
+  uint32_t i;
+
+  for (i = 0; i < pool->num_slabs; i++)
+    free(pool->slabs[i]);
+  free(pool->slabs);
+  pool->slabs = NULL;
+  pool->num_slabs = pool->max_slabs = 0;
+  pool->next = 1;
+  pool->free_list = 0;
+}
+
+// Return the index of a new vector table, recycling freed ones first
+static uint32_t vector_table_alloc(vector_pool *pool) {
+  uint32_t index;
+
+  if (pool->free_list) {
+    index = pool->free_list;
+    pool->free_list = VECTOR_TABLE(pool, index)->forward_nic;
+    return index;
   }
-  cmp = subnet_cmp(net, m->net);
-  if (cmp < 0) {
-    m->left = map_insert(m->left, net, table);
-  } else if (cmp > 0) {
-    m->right = map_insert(m->right, net, table);
-  } else {
-    m->table = table;
+  if ((pool->next & (VECTOR_SLAB_SIZE - 1)) == 0 || pool->num_slabs == 0) {
+    if (pool->num_slabs == pool->max_slabs) {
+      pool->max_slabs = pool->max_slabs ? pool->max_slabs * 2 : 16;
+      pool->slabs = (char**) realloc(pool->slabs, pool->max_slabs * sizeof(char*));
+      if (!pool->slabs) {
+        perror("Could not allocate routing table");
+        exit(EXIT_FAILURE);
+      }
+    }
+    pool->slabs[pool->num_slabs] = (char*) malloc(VECTOR_SLAB_SIZE * pool->table_size);
+    if (!pool->slabs[pool->num_slabs]) {
+      perror("Could not allocate routing table");
+      exit(EXIT_FAILURE);
+    }
+    pool->num_slabs++;
   }
-  return m;
+  return pool->next++;
+}
+
+static void vector_table_free(vector_pool *pool, uint32_t index) {
+  VECTOR_TABLE(pool, index)->forward_nic = pool->free_list;
+  pool->free_list = index;
 }
 
-vector_table* map_lookup(map* m, subnet net) {
-  int cmp;
+static inline uint32_t map_hash(const map *m, subnet net) {
+  uint64_t key = (uint64_t) net.address << 8 | net.size;
 
-  if (m == NULL) {
-    return NULL;
+  return (uint32_t) ((key * 0x9E3779B97F4A7C15ULL) >> 32) & m->mask;
+}
+
+static void map_alloc_slots(map *m, uint32_t num_slots) {
+  m->slots = (map_entry*) calloc(num_slots, sizeof(map_entry));
+  if (!m->slots) {
+    perror("Could not allocate routing table");
+    exit(EXIT_FAILURE);
   }
-  cmp = subnet_cmp(net, m->net);
-  if (cmp != 0) {
-    return map_lookup((cmp>0) ? (m->right) : (m->left), net);
-  } else {
-    return m->table;
+  m->mask = num_slots - 1;
+}
+
+void map_init(map *m, int num_nics) {
+  map_alloc_slots(m, MAP_MIN_SLOTS);
+  m->count = 0;
+  vector_pool_init(&m->pool, num_nics);
+}
+
+void map_destroy(map *m) {
+  free(m->slots);
+  m->slots = NULL;
+  m->mask = m->count = 0;
+  vector_pool_destroy(&m->pool);
+}
+
+// Slot holding net, or the empty slot where it would go
+static inline uint32_t map_find(const map *m, subnet net) {
+  uint32_t i = map_hash(m, net);
+
+  while (m->slots[i].routes &&
+         (m->slots[i].address != net.address || m->slots[i].size != net.size))
+    i = (i + 1) & m->mask;
+  return i;
+}
+
+// Double the number of slots and reinsert every entry
+static void map_grow(map *m) {
+  map_entry *old = m->slots;
+  uint32_t i, old_slots = m->mask + 1;
+  subnet net;
+
+  map_alloc_slots(m, old_slots * 2);
+  for (i = 0; i < old_slots; i++) {
+    if (!old[i].routes) continue;
+    net.address = old[i].address;
+    net.size = old[i].size;
+    m->slots[map_find(m, net)] = old[i];
   }
+  free(old);
+}
+
+map_entry* map_lookup(map *m, subnet net) {
+  uint32_t i = map_find(m, net);
+
+  return m->slots[i].routes ? &m->slots[i] : NULL;
 }
 
-map* map_delete(map *m, subnet net) {
-  int cmp;
-  map **pred, *tmp;
+/* Returns the entry of net, adding the subnet if it is not in the map
+ * yet. A new entry has no routes, which the caller must add before
+ * any other map operation (an entry without routes is an empty slot).
+ */
+map_entry* map_insert(map *m, subnet net) {
+  uint32_t i;
 
-  if (m == NULL) {
-    return NULL;
+  if (4 * (m->count + 1) > 3 * (m->mask + 1))
+    map_grow(m);
+  i = map_find(m, net);
+  if (!m->slots[i].routes) {
+    m->slots[i].address = net.address;
+    m->slots[i].size = net.size;
+    m->count++;
   }
-  cmp = subnet_cmp(net, m->net);
-  if (cmp < 0) {
-    m->left = map_delete(m->left, net);
-  } else if (cmp > 0) {
-    m->right = map_delete(m->right, net);
-  } else {
-    if (!m->left && !m->right) {
-      free(m->table);
-      free(m);
-      return NULL;
-    } else if (m->left && m->right) {
-      pred = &(m->left);
-      while ((*pred)->right) {
-        pred = &((*pred)->right);
-      }
-      free(m->table);
-      m->net = (*pred)->net;
-      m->table = (*pred)->table;
-      free(*pred);
-      *pred = NULL;
-    } else {
-      tmp = (m->left) ? (m->left) : m->right;
-      free(m->table);
-      free(m);
-      return tmp;
+  return &m->slots[i];
+}
+
+/* Removes net, then moves back the entries of the probe run after it
+ * that may no longer be reachable through the hole.
+ */
+void map_delete(map *m, subnet net) {
+  uint32_t i, j, home;
+  subnet other;
+
+  i = map_find(m, net);
+  if (!m->slots[i].routes)
+    return;
+  if (m->slots[i].routes == VECTOR_DENSE)
+    vector_table_free(&m->pool, m->slots[i].table);
+  m->count--;
+
+  for (j = (i + 1) & m->mask; m->slots[j].routes; j = (j + 1) & m->mask) {
+    other.address = m->slots[j].address;
+    other.size = m->slots[j].size;
+    home = map_hash(m, other);
+    // the entry at j can fill the hole unless its home lies in (i, j]
+    if (((j - home) & m->mask) >= ((j - i) & m->mask)) {
+      m->slots[i] = m->slots[j];
+      i = j;
     }
   }
-  return m;
+  m->slots[i].routes = 0;
 }
@@ -6,6 +6,7 @@
 #ifndef _IP_ROUTE_H_
 #define _IP_ROUTE_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include "capacity.h"
@@ -20,30 +21,107 @@ typedef struct subnet {
   uint8_t size;
 } subnet;
 
+/* Largest number of NICs a router can be configured with. */
+#define MAX_NICS 65536
+
+/* Dense distance vector of a subnet: the distance through each of the
+ * router's NICs, the NIC with the smallest one (the lowest such NIC
+ * on ties), and how many NICs reach the subnet at all. The number of
+ * NICs is set at run time, so dist has as many entries as the router
+ * has NICs.
+ */
 typedef struct vector_table {
   int forward_nic;
-  int dist[NUM_NICS];
+  int reachable;
+  uint16_t dist[];
 } vector_table;
 
+/* Vector tables come from slabs that never move, so a table stays at
+ * the same address until its subnet is deleted. Index 0 is never
+ * handed out; free tables are chained through forward_nic. Tables are
+ * table_size bytes apart, which depends on the number of NICs.
+ */
+#define VECTOR_SLAB_BITS 10
+#define VECTOR_SLAB_SIZE (1U << VECTOR_SLAB_BITS)
+#define VECTOR_TABLE(pool, index) \
+  ((vector_table*) ((pool)->slabs[(index) >> VECTOR_SLAB_BITS] + \
+                    ((index) & (VECTOR_SLAB_SIZE - 1)) * (pool)->table_size))
+
+typedef struct vector_pool {
+  char **slabs;
+  size_t table_size;
+  uint32_t num_slabs, max_slabs;
+  uint32_t next;
+  uint32_t free_list;
+} vector_pool;
+
+/* A NIC that reaches a subnet, and the distance through it. Distances
+ * never exceed METRIC_UNREACHABLE, so they fit in 16 bits.
+ */
+typedef struct vector_route {
+  uint16_t nic;
+  uint16_t dist;
+} vector_route;
+
+/* Most subnets are only reachable through a NIC or two, so the map
+ * keeps up to VECTOR_INLINE routes of a subnet in the entry itself,
+ * forwarding route first; NICs not listed do not reach the subnet. A
+ * subnet reached through more NICs than that moves to a dense vector
+ * table, and back when all but VECTOR_INLINE / 2 of them are gone.
+ */
+#define VECTOR_INLINE 2
+#define VECTOR_DENSE 0xFF
+
+/* Open-addressing hash map from subnet to distance vector, with linear
+ * probing and backward-shift deletion (no tombstones). It keeps at
+ * most three quarters of its slots in use.
+ */
+typedef struct map_entry {
+  uint32_t address;
+  uint8_t size;
+  uint8_t routes;   // number of inline routes, VECTOR_DENSE, or 0 for an empty slot
+  union {
+    vector_route route[VECTOR_INLINE];
+    uint32_t table; // pool index of the vector table if routes is VECTOR_DENSE
+  };
+} map_entry;
+
 typedef struct map {
-  subnet net;
-  vector_table *table;
-  struct map *left, *right;
+  map_entry *slots;
+  uint32_t mask;
+  uint32_t count;
+  vector_pool pool;
 } map;
 
+/* Receives the advertisements of a router instead of the standard
+ * output: a new route to ip/netsize through nic (-1 if the subnet is
+ * now unreachable), at distance metric.
+ */
+typedef void (*route_advertiser)(void *arg, uint32_t ip, uint8_t netsize, int nic,
+                                 unsigned int metric, unsigned int update_id);
+
 typedef struct router_state {
-  map* map;
+  map map;
+  int num_nics;
+  route_advertiser advertise;
+  void *advertise_arg;
 } *router_state;
 
-void traverse(map* m, int depth);
+void traverse(map *m);
 int subnet_cmp(subnet net_1, subnet net_2);
-map* map_insert(map *m, subnet net, vector_table *table);
-vector_table* map_lookup(map* m, subnet net);
-map* map_delete(map *m, subnet net);
+void map_init(map *m, int num_nics);
+void map_destroy(map *m);
+map_entry* map_insert(map *m, subnet net);
+map_entry* map_lookup(map *m, subnet net);
+void map_delete(map *m, subnet net);
 
 router_state initialize_router(void);
-void process_update(router_state *state, uint32_t ip, uint8_t netsize,
+int set_num_nics(router_state state, int num_nics);
+void set_route_advertiser(router_state state, route_advertiser advertise, void *arg);
+int process_update(router_state *state, uint32_t ip, uint8_t netsize,
 		    int nic, unsigned int metric, unsigned int update_id);
+void print_advertisement(uint32_t ip, uint8_t netsize, int nic,
+                         unsigned int metric, unsigned int update_id);
 void destroy_router(router_state state);
 
 #endif
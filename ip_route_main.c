@@ -8,44 +8,193 @@
 #include <string.h>
 #include <strings.h>
 #include <ctype.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <signal.h>
 
 #include "ip_route.h"
+#include "shard.h"
+#include "input.h"
+#include "output.h"
+#include "trace.h"
+#include "latency.h"
 
 /* Largest line in the input file. */
 #define MAXLINE 1000
 
+/* Set by SIGUSR1 to dump the latency histograms. */
+static volatile sig_atomic_t latency_requested;
+
+static void request_latency(int sig) {
+  latency_requested = 1;
+}
+
+static void print_latency(void) {
+  latency_requested = 0;
+  latency_print(stderr);
+}
+
+/* Shards the updates are spread over, if enabled with --threads. */
+static shard_router *shards;
+
+static int route_update(router_state state, uint32_t ip, uint8_t netsize, int nic,
+                        unsigned int metric, unsigned int update_id) {
+  if (shards)
+    return shard_update(shards, ip, netsize, nic, metric, update_id);
+  return process_update(&state, ip, netsize, nic, metric, update_id);
+}
+
+// Output that goes out after the advertisements of the updates before it
+static void write_in_order(const char *data, size_t len) {
+  if (shards)
+    shard_write(shards, data, len);
+  else
+    output_write(&out_stdout, data, len);
+}
+
+// Same for error messages, printed as fprintf(stderr, format, len, text)
+static void report_in_order(const char *format, const char *text, size_t len) {
+  if (shards)
+    shard_error(shards, format, text, len);
+  else
+    fprintf(stderr, format, (int) len, text);
+}
+
+static void process_binary(router_state state, input *in) {
+  trace_record rec;
+  static const char truncated[] = "Truncated binary trace\n";
+  static const char invalid[] = "Invalid record in binary trace\n";
+  char buf[OUTPUT_RECORD_MAX];
+  int rc, n;
+
+  while ((rc = input_next_record(in, &rec)) > 0) {
+    if (latency_requested)
+      print_latency();
+    if (rec.type == 'U') {
+      if (route_update(state, rec.ip, rec.netsize, rec.nic, rec.metric, rec.id)) {
+        n = snprintf(buf, sizeof(buf), "Invalid NIC in update %u: %d\n", rec.id, rec.nic);
+        report_in_order("%.*s", buf, n);
+      }
+    }
+    else if (rec.type == 'P') {
+      write_in_order(buf, format_trace_record(buf, &rec) - buf);
+    }
+    else {
+      report_in_order("Invalid input record: %.*s\n", (const char*) &rec.type, 1);
+    }
+  }
+  if (rc == -1)
+    report_in_order("%.*s", truncated, strlen(truncated));
+  else if (rc < 0)
+    report_in_order("%.*s", invalid, strlen(invalid));
+}
+
 int main(int argc, char *argv[]) {
   
-  char line[MAXLINE];
+  static const struct option options[] = {
+    { "binary", no_argument, NULL, 'b' },
+    { "latency", no_argument, NULL, 'L' },
+    { "nics", required_argument, NULL, 'n' },
+    { "threads", required_argument, NULL, 'j' },
+    { NULL, 0, NULL, 0 }
+  };
+
+  input in;
+  const char *line;
+  size_t len;
   unsigned int netsize;
-  unsigned int ip[4];
+  uint32_t ip;
   int nic;
   unsigned int metric, update_id;
   router_state state;
+  int binary_input = 0;
+  int num_nics = NUM_NICS;
+  int num_threads = 0;
+  unsigned long value;
+  char *end;
+  int opt;
+  
+  while ((opt = getopt_long(argc, argv, "bLn:j:", options, NULL)) != -1) {
+    switch (opt) {
+    case 'b':
+      binary_input = 1;
+      break;
+    case 'L':
+      latency_enable();
+      break;
+    case 'n':
+      value = strtoul(optarg, &end, 10);
+      if (*end || value < 1 || value > MAX_NICS) {
+        fprintf(stderr, "Number of NICs must be between 1 and %d\n", MAX_NICS);
+        return 2;
+      }
+      num_nics = value;
+      break;
+    case 'j':
+      value = strtoul(optarg, &end, 10);
+      if (*end || value < 1 || value > 1024) {
+        fprintf(stderr, "Number of threads must be between 1 and 1024\n");
+        return 2;
+      }
+      num_threads = value;
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [--binary] [--latency] [--nics=N] [--threads=N]\n", argv[0]);
+      return 2;
+    }
+  }
+  if (num_threads && latency_enabled) {
+    fprintf(stderr, "Latency can't be recorded with threads\n");
+    return 2;
+  }
+  
+  if (input_open(&in, STDIN_FILENO)) {
+    perror("Could not read input");
+    return 2;
+  }
+  if (binary_input && input_read_trace_header(&in)) {
+    fprintf(stderr, "Input is not a binary trace\n");
+    return 2;
+  }
   
   state = initialize_router();
+  set_num_nics(state, num_nics);
+  signal(SIGUSR1, request_latency);
+  if (num_threads && !(shards = shard_start(num_threads, num_nics))) {
+    perror("Could not start threads");
+    return 2;
+  }
+  
+  if (binary_input)
+    process_binary(state, &in);
   
-  while(fgets(line, MAXLINE, stdin)) {
+  while(!binary_input && input_next_line(&in, MAXLINE, &line, &len)) {
     
+    if (latency_requested)
+      print_latency();
+
     if (toupper(line[0]) == 'U') {
       
-      if (sscanf(line, "U %u.%u.%u.%u/%u %d %u %u",
-                 &ip[0], &ip[1], &ip[2], &ip[3], &netsize, &nic, &metric, &update_id) < 6)
-        fprintf(stderr, "Invalid table entry input: %s", line);
-      else
-        process_update(&state, ip[0] << 24 | ip[1] << 16 | ip[2] << 8 | ip[3], netsize,
-                       nic, metric, update_id);
+      if (scan_update(line, len, &ip, &netsize, &nic, &metric, &update_id) < 6)
+        report_in_order("Invalid table entry input: %.*s", line, len);
+      else if (route_update(state, ip, netsize, nic, metric, update_id))
+        report_in_order("Invalid NIC in update: %.*s", line, len);
     }
     else if (toupper(line[0]) == 'P') {
       
       // Packet inputs are output exactly as they are. This allows piping to part 1.
-      printf("%s", line);
+      write_in_order(line, len);
     }
     else {
       
-      fprintf(stderr, "Invalid input line: %s\n", line);
+      report_in_order("Invalid input line: %.*s\n", line, len);
     }
   }
+  if (shards)
+    shard_finish(shards);
+  input_close(&in);
+  output_flush(&out_stdout);
+  latency_print(stderr);
 
   destroy_router(state);
   
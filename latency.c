@@ -0,0 +1,84 @@
+/*
+ * latency.c
+ * Author:
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "latency.h"
+
+int latency_enabled;
+latency_histogram latency_histograms[LATENCY_OPS];
+
+static const char *latency_names[LATENCY_OPS] = { "lookup", "insert", "delete", "route update" };
+
+// Counter and clock readings at latency_enable, to convert cycles to ns
+static uint64_t start_ticks, start_ns;
+
+static uint64_t clock_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void latency_enable(void) {
+  memset(latency_histograms, 0, sizeof(latency_histograms));
+  start_ns = clock_ns();
+  start_ticks = latency_now();
+  latency_enabled = 1;
+}
+
+// Largest value that falls in bucket b
+static uint64_t latency_bucket_max(unsigned b) {
+  unsigned e, sub;
+
+  if (b < LATENCY_SUB)
+    return b;
+  e = b / LATENCY_SUB + LATENCY_SUB_BITS - 1;
+  sub = b % LATENCY_SUB;
+  return ((uint64_t) (LATENCY_SUB + sub + 1) << (e - LATENCY_SUB_BITS)) - 1;
+}
+
+// Smallest bucket bound at or above the p-th percentile
+static uint64_t latency_percentile(const latency_histogram *h, double p) {
+  uint64_t rank, seen = 0;
+  unsigned b;
+
+  rank = (uint64_t) (p / 100 * h->count);
+  if (rank < 1) rank = 1;
+  for (b = 0; b < LATENCY_BUCKETS; b++) {
+    seen += h->buckets[b];
+    if (seen >= rank)
+      return latency_bucket_max(b) < h->max ? latency_bucket_max(b) : h->max;
+  }
+  return h->max;
+}
+
+/* Prints count, p50, p99, p99.9 and max of every operation seen so
+ * far, in ns (the cycle counter is calibrated against the clock over
+ * the time since latency_enable).
+ */
+void latency_print(FILE *output) {
+  const latency_histogram *h;
+  uint64_t ticks, ns;
+  double scale;
+  int op;
+
+  if (!latency_enabled) return;
+  ns = clock_ns() - start_ns;
+  ticks = latency_now() - start_ticks;
+  scale = (ticks && ns) ? (double) ns / ticks : 1.0;
+
+  fprintf(output, "Latency (ns)       count        p50        p99      p99.9        max\n");
+  for (op = 0; op < LATENCY_OPS; op++) {
+    h = &latency_histograms[op];
+    if (!h->count) continue;
+    fprintf(output, "  %-12s %11llu %10.0f %10.0f %10.0f %10.0f\n", latency_names[op],
+            (unsigned long long) h->count, latency_percentile(h, 50) * scale,
+            latency_percentile(h, 99) * scale, latency_percentile(h, 99.9) * scale, h->max * scale);
+  }
+}
@@ -0,0 +1,90 @@
+/*
+ *  latency.h
+ *  Author:
+ */
+
+#ifndef _LATENCY_H_
+#define _LATENCY_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+
+/* Latency histograms of the table operations, shared by ip_forward
+ * and ip_route. Operations are timed with the cycle counter and
+ * recorded in log-linear buckets: exact below 16 cycles, then 16
+ * buckets per power of two (about 6% resolution). Recording is a
+ * couple of additions, so timing can stay enabled; when it is not,
+ * the cost is one predictable branch per operation.
+ */
+#define LATENCY_SUB_BITS 4
+#define LATENCY_SUB (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS (64 * LATENCY_SUB)
+
+typedef enum latency_op {
+  LATENCY_LOOKUP,
+  LATENCY_INSERT,
+  LATENCY_DELETE,
+  LATENCY_ROUTE_UPDATE,
+  LATENCY_OPS
+} latency_op;
+
+typedef struct latency_histogram {
+  uint64_t count;
+  uint64_t max;
+  uint64_t buckets[LATENCY_BUCKETS];
+} latency_histogram;
+
+extern int latency_enabled;
+extern latency_histogram latency_histograms[LATENCY_OPS];
+
+void latency_enable(void);
+void latency_print(FILE *output);
+
+static inline uint64_t latency_now(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static inline unsigned latency_bucket(uint64_t v) {
+  unsigned e;
+
+  if (v < LATENCY_SUB)
+    return v;
+  e = 63 - __builtin_clzll(v);
+  return (e - LATENCY_SUB_BITS + 1) * LATENCY_SUB + ((v >> (e - LATENCY_SUB_BITS)) & (LATENCY_SUB - 1));
+}
+
+// Start timing an operation (0 if timing is off)
+static inline uint64_t latency_start(void) {
+  return latency_enabled ? latency_now() : 0;
+}
+
+/* Records the time since start, spread evenly over count operations
+ * that were carried out together (e.g. a batch of lookups).
+ */
+static inline void latency_record(latency_op op, uint64_t start, uint32_t count) {
+  latency_histogram *h;
+  uint64_t v;
+
+  if (!latency_enabled || !count) return;
+  h = &latency_histograms[op];
+  v = (latency_now() - start) / count;
+  h->buckets[latency_bucket(v)] += count;
+  h->count += count;
+  if (v > h->max)
+    h->max = v;
+}
+
+#endif
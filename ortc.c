@@ -0,0 +1,335 @@
+/*
+ * ortc.c
+ * Author:
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ortc.h"
+
+// Bit of a NIC in the sets of ortc_node; NICs from -1 to 62 fit
+#define ORTC_SET(nic) (1ULL << ((nic) + 1))
+#define ORTC_MAX_NIC 62
+
+// Add a prefix to the list, growing it as needed
+static void ortc_push(ortc_list *list, uint32_t key, uint8_t bits, int value) {
+  radix_prefix *entries;
+
+  if (list->failed) return;
+  if (list->count == list->capacity) {
+    list->capacity = list->capacity ? list->capacity * 2 : 256;
+    entries = (radix_prefix*) realloc(list->entries, list->capacity * sizeof(radix_prefix));
+    if (!entries) {
+      list->failed = 1;
+      return;
+    }
+    list->entries = entries;
+  }
+  list->entries[list->count].key = key;
+  list->entries[list->count].bits = bits;
+  list->entries[list->count++].value = value;
+}
+
+static void ortc_collect(uint32_t ip, uint8_t netsize, int nic, void *arg) {
+  ortc_push((ortc_list*) arg, ip & PREFIX_MASK(min(netsize, 32)), netsize, nic);
+}
+
+static int64_t ortc_node_alloc(ortc *o) {
+  ortc_node *nodes;
+
+  if (o->num_nodes == o->max_nodes) {
+    o->max_nodes = o->max_nodes ? o->max_nodes * 2 : 1024;
+    nodes = (ortc_node*) realloc(o->nodes, (size_t) o->max_nodes * sizeof(ortc_node));
+    if (!nodes) return -1;
+    o->nodes = nodes;
+  }
+  o->nodes[o->num_nodes].child[0] = o->nodes[o->num_nodes].child[1] = 0;
+  o->nodes[o->num_nodes].nic = -2;
+  return o->num_nodes++;
+}
+
+/* First two passes of ORTC over the subtree of node n: a leaf can
+ * only be covered by the NIC it inherits, an inner node by the NICs
+ * both of its sides can be covered by if there are any, or else by
+ * those of either side. A missing side is a leaf with the node's
+ * inherited NIC.
+ */
+static uint64_t ortc_sets(ortc *o, uint32_t n, int inherited) {
+  ortc_node *node = &o->nodes[n];
+  uint64_t side[2];
+  int c;
+
+  if (node->nic != -2)
+    inherited = node->nic;
+  node->inherited = inherited;
+  for (c = 0; c < 2; c++)
+    side[c] = node->child[c] ? ortc_sets(o, node->child[c], inherited) : ORTC_SET(inherited);
+  node->set = (side[0] & side[1]) ? side[0] & side[1] : side[0] | side[1];
+  return node->set;
+}
+
+/* Last pass of ORTC: node n, at key/bits, keeps the NIC its addresses
+ * get from above if it can be covered by it; otherwise it picks one of
+ * its set and becomes a prefix. A missing side becomes a prefix if its
+ * NIC is not the one picked. Prefixes are added in preorder.
+ */
+static void ortc_select(ortc *o, uint32_t n, uint32_t key, uint8_t bits, int nic) {
+  ortc_node *node = &o->nodes[n];
+  int c;
+
+  if (!(node->set & ORTC_SET(nic))) {
+    nic = __builtin_ctzll(node->set) - 1;
+    ortc_push(&o->out, key, bits, nic);
+  }
+  for (c = 0; c < 2; c++) {
+    if (node->child[c])
+      ortc_select(o, node->child[c], key | (uint32_t) c << (31 - bits), bits + 1, nic);
+    else if (node->inherited != nic)
+      ortc_push(&o->out, key | (uint32_t) c << (31 - bits), bits + 1, node->inherited);
+  }
+}
+
+/* Aggregates the n prefixes in, all in the block starting at block,
+ * whose addresses the FIB sends to inherited otherwise, into o->out.
+ * Prefixes with NICs that don't fit the sets are copied as they are.
+ */
+static void ortc_aggregate(ortc *o, const radix_prefix *in, uint32_t n, uint32_t block, int inherited) {
+  uint32_t i, node, bit;
+  int64_t child;
+  uint8_t b, bits;
+
+  o->out.count = 0;
+  for (i = 0; i < n; i++) {
+    if (in[i].value < -1 || in[i].value > ORTC_MAX_NIC || inherited < -1 || inherited > ORTC_MAX_NIC)
+      break;
+  }
+  if (i < n) {
+    for (i = 0; i < n; i++)
+      ortc_push(&o->out, in[i].key, min(in[i].bits, 32), in[i].value);
+    return;
+  }
+  if (!n) return;
+
+  o->num_nodes = 0;
+  if (ortc_node_alloc(o) < 0) {
+    o->out.failed = 1;
+    return;
+  }
+  for (i = 0; i < n; i++) {
+    node = 0;
+    // a netsize past 32 is a host route, as the radix lookups take it
+    bits = min(in[i].bits, 32);
+    for (b = ORTC_BLOCK_BITS; b < bits; b++) {
+      bit = (in[i].key >> (31 - b)) & 1;
+      if (!o->nodes[node].child[bit]) {
+        child = ortc_node_alloc(o);
+        if (child < 0) {
+          o->out.failed = 1;
+          return;
+        }
+        o->nodes[node].child[bit] = child;
+      }
+      node = o->nodes[node].child[bit];
+    }
+    o->nodes[node].nic = in[i].value;
+  }
+  ortc_sets(o, 0, inherited);
+  ortc_select(o, 0, block, ORTC_BLOCK_BITS, inherited);
+}
+
+// Widen the range of addresses the FIB changed in to cover key/bits
+static void ortc_changed(ortc *o, uint32_t key, uint8_t bits) {
+  uint64_t last = key + (1ULL << (32 - bits)) - 1;
+
+  if (o->changed_first > o->changed_last || key < o->changed_first)
+    o->changed_first = key;
+  if (o->changed_first > o->changed_last || last > o->changed_last)
+    o->changed_last = last;
+}
+
+/* Aggregates the block starting at block again from the configured
+ * tree, and replaces the FIB prefixes of the block that changed.
+ * Returns -1 if memory runs out.
+ */
+static int ortc_block(ortc *o, radix_pool *pool, uint32_t tree, uint32_t block) {
+  radix_prefix *old, *out;
+  uint32_t prefix, i, j;
+  uint8_t prefix_bits;
+  int inherited = -1, unused;
+
+  o->in.count = o->old.count = 0;
+  tree = radix_subtree(pool, tree, ORTC_BLOCK_BITS, block, &prefix_bits, &prefix, &inherited);
+  radix_inorder_print(pool, tree, prefix_bits, prefix, ortc_collect, &o->in);
+  if (o->in.failed) return -1;
+  ortc_aggregate(o, o->in.entries, o->in.count, block, inherited);
+  tree = radix_subtree(&o->pool, o->tree, ORTC_BLOCK_BITS, block, &prefix_bits, &prefix, &unused);
+  radix_inorder_print(&o->pool, tree, prefix_bits, prefix, ortc_collect, &o->old);
+  if (o->out.failed || o->old.failed) return -1;
+
+  // both lists are sorted by address and then length; merge them
+  old = o->old.entries;
+  out = o->out.entries;
+  for (i = j = 0; i < o->old.count || j < o->out.count; ) {
+    if (j == o->out.count || (i < o->old.count &&
+        (old[i].key < out[j].key || (old[i].key == out[j].key && old[i].bits < out[j].bits)))) {
+      o->tree = radix_delete(&o->pool, o->tree, old[i].bits, old[i].key);
+      o->num_prefixes--;
+      ortc_changed(o, old[i].key, old[i].bits);
+      i++;
+    } else if (i == o->old.count || old[i].key != out[j].key || old[i].bits != out[j].bits) {
+      o->tree = radix_insert(&o->pool, o->tree, out[j].bits, out[j].key, out[j].value);
+      o->num_prefixes++;
+      ortc_changed(o, out[j].key, out[j].bits);
+      j++;
+    } else {
+      if (old[i].value != out[j].value) {
+        o->tree = radix_insert(&o->pool, o->tree, out[j].bits, out[j].key, out[j].value);
+        ortc_changed(o, out[j].key, out[j].bits);
+      }
+      i++;
+      j++;
+    }
+  }
+  return 0;
+}
+
+// Whether the tree has a prefix key/bits, and its value if so
+static int ortc_find(radix_pool *pool, uint32_t tree, uint32_t key, uint8_t bits, int *value) {
+  radix_node *node;
+  uint32_t prefix;
+  uint8_t prefix_bits;
+  int unused;
+
+  tree = radix_subtree(pool, tree, bits, key, &prefix_bits, &prefix, &unused);
+  if (tree == RADIX_NIL) return 0;
+  node = RADIX_NODE(pool, tree);
+  if (!node->has_value || prefix_bits + node->bits != bits) return 0;
+  *value = node->value;
+  return 1;
+}
+
+ortc* ortc_create(void) {
+  ortc *o = (ortc*) calloc(1, sizeof(ortc));
+
+  if (!o) return NULL;
+  radix_pool_init(&o->pool);
+  o->tree = RADIX_NIL;
+  o->stale = 1;
+  return o;
+}
+
+/* Builds the FIB of the configured tree from scratch, a block at a
+ * time. o is created if it is NULL. Returns NULL (and frees o) if
+ * memory runs out; the caller should look up the configured tree in
+ * that case.
+ */
+ortc* ortc_build(ortc *o, radix_pool *pool, uint32_t tree) {
+  struct { uint64_t end; int nic; } stack[ORTC_BLOCK_BITS + 1];
+  radix_prefix *prefixes;
+  ortc_list all;
+  uint32_t count, i, j, k, block;
+  int depth;
+
+  if (!o && !(o = ortc_create()))
+    return NULL;
+  radix_pool_destroy(&o->pool);
+  radix_pool_init(&o->pool);
+  o->tree = RADIX_NIL;
+  o->in.failed = o->out.failed = o->old.failed = 0;
+
+  prefixes = radix_prefixes(pool, tree, &count);
+  if (!prefixes) {
+    ortc_free(o);
+    return NULL;
+  }
+  memset(&all, 0, sizeof(all));
+  // shorter prefixes containing the current block, innermost last
+  depth = 0;
+  for (i = 0; i < count; i = j) {
+    block = prefixes[i].key & PREFIX_MASK(ORTC_BLOCK_BITS);
+    while (depth && stack[depth - 1].end <= block)
+      depth--;
+    if (prefixes[i].bits < ORTC_BLOCK_BITS) {
+      stack[depth].end = prefixes[i].key + (1ULL << (32 - prefixes[i].bits));
+      stack[depth++].nic = prefixes[i].value;
+      ortc_push(&all, prefixes[i].key, prefixes[i].bits, prefixes[i].value);
+      j = i + 1;
+      continue;
+    }
+    for (j = i + 1; j < count && prefixes[j].bits >= ORTC_BLOCK_BITS &&
+                    (prefixes[j].key & PREFIX_MASK(ORTC_BLOCK_BITS)) == block; j++)
+      ;
+    ortc_aggregate(o, prefixes + i, j - i, block, depth ? stack[depth - 1].nic : -1);
+    for (k = 0; k < o->out.count; k++)
+      ortc_push(&all, o->out.entries[k].key, o->out.entries[k].bits, o->out.entries[k].value);
+  }
+  free(prefixes);
+  if (all.failed || o->out.failed) {
+    free(all.entries);
+    ortc_free(o);
+    return NULL;
+  }
+  // blocks come out in preorder too, so all is sorted
+  o->tree = radix_build(&o->pool, all.entries, all.count);
+  o->num_prefixes = all.count;
+  o->stale = 0;
+  free(all.entries);
+  return o;
+}
+
+/* Brings the FIB up to date after the configured tree changed at
+ * ip/netsize: aggregates the block of the prefix again, or copies a
+ * prefix shorter than a block and aggregates all of the blocks under
+ * it again. Returns 1 and sets changed_ip/changed_bits to a prefix
+ * holding every address the FIB now forwards differently, 0 if the FIB
+ * did not change, or -1 if memory runs out; the FIB must then be built
+ * again.
+ */
+int ortc_update(ortc *o, radix_pool *pool, uint32_t tree, uint32_t ip, uint8_t netsize,
+                uint32_t *changed_ip, uint8_t *changed_bits) {
+  uint32_t block, count;
+  int value, old, present, copied;
+
+  o->changed_first = 1;
+  o->changed_last = 0;
+  if (netsize >= ORTC_BLOCK_BITS) {
+    if (ortc_block(o, pool, tree, ip & PREFIX_MASK(ORTC_BLOCK_BITS)))
+      return -1;
+  } else {
+    ip &= PREFIX_MASK(netsize);
+    present = ortc_find(pool, tree, ip, netsize, &value);
+    copied = ortc_find(&o->pool, o->tree, ip, netsize, &old);
+    if (present && (!copied || old != value)) {
+      o->tree = radix_insert(&o->pool, o->tree, netsize, ip, value);
+      o->num_prefixes += !copied;
+      ortc_changed(o, ip, netsize);
+    } else if (!present && copied) {
+      o->tree = radix_delete(&o->pool, o->tree, netsize, ip);
+      o->num_prefixes--;
+      ortc_changed(o, ip, netsize);
+    }
+    block = ip;
+    for (count = 1U << (ORTC_BLOCK_BITS - netsize); count--; block += 1U << (32 - ORTC_BLOCK_BITS)) {
+      if (ortc_block(o, pool, tree, block))
+        return -1;
+    }
+  }
+  if (o->changed_first > o->changed_last)
+    return 0;
+  *changed_bits = (o->changed_first == o->changed_last) ? 32 :
+                  __builtin_clz((uint32_t) (o->changed_first ^ o->changed_last));
+  *changed_ip = o->changed_first & PREFIX_MASK(*changed_bits);
+  return 1;
+}
+
+void ortc_free(ortc *o) {
+  if (!o) return;
+  radix_pool_destroy(&o->pool);
+  free(o->nodes);
+  free(o->in.entries);
+  free(o->out.entries);
+  free(o->old.entries);
+  free(o);
+}
@@ -0,0 +1,60 @@
+/*
+ *  ortc.h
+ *  Author:
+ */
+
+#ifndef _ORTC_H_
+#define _ORTC_H_
+
+#include <stdint.h>
+
+#include "ip_forward.h"
+
+/* Aggregation of the forwarding table with ORTC (Optimal Routing
+ * Table Constructor): the lookups go to a second tree, the FIB,
+ * holding the fewest prefixes that forward every address as the
+ * configured tree does. Prefixes can be dropped under a covering
+ * prefix with the same NIC, siblings with the same NIC merged, and a
+ * FIB prefix may hold -1, for addresses with no route under one that
+ * has a route.
+ *
+ * The address space is aggregated in blocks of ORTC_BLOCK_BITS bits,
+ * so that an update only aggregates again the block it falls in.
+ * Prefixes shorter than a block are copied to the FIB as they are;
+ * that way each block only depends on its own prefixes and the ones
+ * around it.
+ */
+#define ORTC_BLOCK_BITS 12
+
+/* Nodes of the binary trie of a block, one per bit. */
+typedef struct ortc_node {
+  uint32_t child[2];   // 0 for none (node 0 is the root)
+  int nic;             // the node's own prefix, or -2
+  int inherited;       // NIC of the longest prefix at or above the node, or -1
+  uint64_t set;        // NICs that can cover the subtree, bit nic + 1
+} ortc_node;
+
+typedef struct ortc_list {
+  radix_prefix *entries;
+  uint32_t count, capacity;
+  uint8_t failed;
+} ortc_list;
+
+typedef struct ortc {
+  radix_pool pool;          // the FIB
+  uint32_t tree;
+  uint32_t num_prefixes;    // prefixes in the FIB
+  uint8_t stale;            // the FIB must be built again from scratch
+  uint64_t changed_first, changed_last;   // addresses changed by ortc_update so far
+  ortc_node *nodes;
+  uint32_t num_nodes, max_nodes;
+  ortc_list in, out, old;   // scratch lists of the block being aggregated
+} ortc;
+
+ortc* ortc_create(void);
+ortc* ortc_build(ortc *o, radix_pool *pool, uint32_t tree);
+int ortc_update(ortc *o, radix_pool *pool, uint32_t tree, uint32_t ip, uint8_t netsize,
+                uint32_t *changed_ip, uint8_t *changed_bits);
+void ortc_free(ortc *o);
+
+#endif
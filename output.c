@@ -0,0 +1,76 @@
+/*
+ * output.c
+ * Author:
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "output.h"
+
+outbuf out_stdout = { STDOUT_FILENO, 0, { 0 } };
+
+const char output_digits[200] =
+  "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+  "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+  "8081828384858687888990919293949596979899";
+
+void output_init(outbuf *out, int fd) {
+  out->fd = fd;
+  out->len = 0;
+}
+
+// Write both pieces completely, retrying on short writes
+static void output_writev(int fd, struct iovec *iov, int iovcnt) {
+  ssize_t rc;
+
+  while (iovcnt > 0) {
+    rc = writev(fd, iov, iovcnt);
+    if (rc < 0) {
+      if (errno == EINTR) continue;
+      perror("Could not write output");
+      exit(EXIT_FAILURE);
+    }
+    while (iovcnt > 0 && (size_t) rc >= iov->iov_len) {
+      rc -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char*) iov->iov_base + rc;
+      iov->iov_len -= rc;
+    }
+  }
+}
+
+void output_flush(outbuf *out) {
+  struct iovec iov;
+
+  if (!out->len) return;
+  iov.iov_base = out->buf;
+  iov.iov_len = out->len;
+  output_writev(out->fd, &iov, 1);
+  out->len = 0;
+}
+
+/* Appends len bytes. When they don't fit, the buffer and the data go
+ * out together in a single writev.
+ */
+void output_write(outbuf *out, const char *data, size_t len) {
+  struct iovec iov[2];
+
+  if (out->len + len <= OUTPUT_BUFSIZE) {
+    memcpy(out->buf + out->len, data, len);
+    out->len += len;
+    return;
+  }
+  iov[0].iov_base = out->buf;
+  iov[0].iov_len = out->len;
+  iov[1].iov_base = (void*) data;
+  iov[1].iov_len = len;
+  output_writev(out->fd, iov, 2);
+  out->len = 0;
+}
@@ -0,0 +1,89 @@
+/*
+ *  output.h
+ *  Author:
+ */
+
+#ifndef _OUTPUT_H_
+#define _OUTPUT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/* Buffered writer used instead of stdio on the output paths. Numbers
+ * and addresses are formatted by hand straight into the buffer, which
+ * goes out with write (or writev, together with a large block) when
+ * it fills up or is flushed.
+ */
+#define OUTPUT_BUFSIZE (1 << 16)
+
+/* Room needed by the longest record written with output_reserve. */
+#define OUTPUT_RECORD_MAX 128
+
+typedef struct outbuf {
+  int fd;
+  size_t len;
+  char buf[OUTPUT_BUFSIZE];
+} outbuf;
+
+/* Buffered standard output shared by the printing helpers. */
+extern outbuf out_stdout;
+
+void output_init(outbuf *out, int fd);
+void output_flush(outbuf *out);
+void output_write(outbuf *out, const char *data, size_t len);
+
+extern const char output_digits[200];
+
+// Make room for n bytes (n <= OUTPUT_RECORD_MAX) and return where they go
+static inline char* output_reserve(outbuf *out, size_t n) {
+  if (out->len + n > OUTPUT_BUFSIZE)
+    output_flush(out);
+  return out->buf + out->len;
+}
+
+static inline void output_commit(outbuf *out, char *end) {
+  out->len = end - out->buf;
+}
+
+// Decimal digits of v at p, return the end
+static inline char* format_uint(char *p, uint32_t v) {
+  char tmp[10], *q = tmp + sizeof(tmp);
+  size_t n;
+
+  while (v >= 100) {
+    q -= 2;
+    memcpy(q, output_digits + (v % 100) * 2, 2);
+    v /= 100;
+  }
+  if (v >= 10) {
+    q -= 2;
+    memcpy(q, output_digits + v * 2, 2);
+  } else {
+    *--q = '0' + v;
+  }
+  n = tmp + sizeof(tmp) - q;
+  memcpy(p, q, n);
+  return p + n;
+}
+
+static inline char* format_int(char *p, int v) {
+  if (v < 0) {
+    *p++ = '-';
+    return format_uint(p, -(uint32_t) v);
+  }
+  return format_uint(p, v);
+}
+
+// Dotted quad of a host-order address
+static inline char* format_ip(char *p, uint32_t ip) {
+  p = format_uint(p, (ip >> 24) & 0xFF);
+  *p++ = '.';
+  p = format_uint(p, (ip >> 16) & 0xFF);
+  *p++ = '.';
+  p = format_uint(p, (ip >> 8) & 0xFF);
+  *p++ = '.';
+  return format_uint(p, ip & 0xFF);
+}
+
+#endif
@@ -0,0 +1,272 @@
+/*
+ * parallel.c
+ * Author:
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "parallel.h"
+#include "output.h"
+#include "trace.h"
+
+#define JOB(pf, i) (&(pf)->jobs[(i) % PARALLEL_JOBS])
+
+// Look up the packets of a job and format the output of the job
+static void parallel_run_job(parallel_forward *pf, parallel_job *job) {
+  const parallel_segment *seg;
+  int nics[FORWARD_BATCH];
+  trace_record rec;
+  char *p = job->out;
+  int i, j, m, s;
+  size_t text = 0;
+
+  memset(&rec, 0, sizeof(rec));
+  rec.type = 'O';
+  for (s = 0, i = 0; s < job->num_segments; s++) {
+    seg = &job->segments[s];
+    for (; i < seg->end; i += m) {
+      m = min(seg->end - i, FORWARD_BATCH);
+      radix_prefix_lookup_batch_counted(&pf->state->pool, &job->counters, seg->tree,
+                                        job->ips + i, nics, m);
+      for (j = 0; j < m; j++) {
+        if (pf->state->binary_output) {
+          rec.id = job->ids[i + j];
+          rec.nic = nics[j];
+          p = trace_encode(p, &rec);
+        } else {
+          *p++ = 'O';
+          *p++ = ' ';
+          p = format_uint(p, job->ids[i + j]);
+          *p++ = ' ';
+          p = format_int(p, nics[j]);
+          *p++ = '\n';
+        }
+      }
+    }
+    memcpy(p, job->text + text, seg->text_end - text);
+    p += seg->text_end - text;
+    text = seg->text_end;
+  }
+  job->out_len = p - job->out;
+}
+
+static void* parallel_worker(void *arg) {
+  parallel_forward *pf = (parallel_forward*) arg;
+  parallel_job *job;
+
+  pthread_mutex_lock(&pf->lock);
+  for (;;) {
+    while (pf->next == pf->tail && !pf->stop)
+      pthread_cond_wait(&pf->work, &pf->lock);
+    if (pf->next == pf->tail)
+      break;
+    job = JOB(pf, pf->next++);
+    pthread_mutex_unlock(&pf->lock);
+
+    parallel_run_job(pf, job);
+
+    pthread_mutex_lock(&pf->lock);
+    job->done = 1;
+    if (job == JOB(pf, pf->head))
+      pthread_cond_signal(&pf->done);
+  }
+  pthread_mutex_unlock(&pf->lock);
+  return NULL;
+}
+
+/* Writes out the finished jobs at the head of the ring, in order, and
+ * reclaims the nodes no job can reach any more. With wait set, first
+ * waits for the head job to finish. The lookups of a job are added to
+ * the pool's counters here, by the thread reading the input, so the
+ * workers never write to them.
+ */
+static void parallel_drain(parallel_forward *pf, int wait) {
+  parallel_job *job;
+  uint32_t epoch;
+
+  pthread_mutex_lock(&pf->lock);
+  if (wait)
+    while (!JOB(pf, pf->head)->done)
+      pthread_cond_wait(&pf->done, &pf->lock);
+  while (pf->head < pf->tail && JOB(pf, pf->head)->done) {
+    job = JOB(pf, pf->head);
+    pthread_mutex_unlock(&pf->lock);
+    output_write(&out_stdout, job->out, job->out_len);
+#ifdef ROUTER_STATS
+    pf->state->pool.counters.lookups += job->counters.lookups;
+    pf->state->pool.counters.visited += job->counters.visited;
+#endif
+    pthread_mutex_lock(&pf->lock);
+    pf->head++;
+  }
+  pthread_mutex_unlock(&pf->lock);
+
+  // the oldest job still to run, the one being filled included
+  if (pf->head < pf->tail || pf->open)
+    epoch = JOB(pf, pf->head)->epoch;
+  else
+    epoch = pf->state->pool.epoch;
+  radix_reclaim(&pf->state->pool, epoch);
+}
+
+// Start filling the job at tail, making room for it first
+static parallel_job* parallel_open(parallel_forward *pf) {
+  parallel_job *job;
+
+  if (pf->tail - pf->head == PARALLEL_JOBS)
+    parallel_drain(pf, 1);
+  job = JOB(pf, pf->tail);
+  job->epoch = pf->state->pool.epoch;
+  job->count = job->num_segments = 0;
+  job->out_len = 0;
+  memset(&job->counters, 0, sizeof(job->counters));
+  job->done = 0;
+  pf->open = 1;
+  return job;
+}
+
+/* Start a segment for packets looked up in the current tree, after
+ * everything already in the job.
+ */
+static void parallel_new_segment(parallel_forward *pf, parallel_job *job) {
+  parallel_segment *seg = &job->segments[job->num_segments++];
+
+  seg->tree = pf->state->tree;
+  seg->end = job->count;
+  seg->text_end = job->num_segments > 1 ? seg[-1].text_end : 0;
+}
+
+// Hand the job being filled to the workers
+static void parallel_close(parallel_forward *pf) {
+  if (!pf->open)
+    return;
+  pf->open = 0;
+  pthread_mutex_lock(&pf->lock);
+  pf->tail++;
+  pthread_cond_signal(&pf->work);
+  pthread_mutex_unlock(&pf->lock);
+  parallel_drain(pf, 0);
+}
+
+/* Starts num_threads workers doing the lookups of state, which must
+ * use the radix engine without a flow cache. Returns NULL if the
+ * threads could not be started.
+ */
+parallel_forward* parallel_start(router_state state, int num_threads) {
+  parallel_forward *pf;
+  int i;
+
+  pf = (parallel_forward*) calloc(1, sizeof(parallel_forward));
+  if (!pf)
+    return NULL;
+  pf->jobs = (parallel_job*) malloc(PARALLEL_JOBS * sizeof(parallel_job));
+  pf->threads = (pthread_t*) malloc(num_threads * sizeof(pthread_t));
+  if (!pf->jobs || !pf->threads) {
+    free(pf->jobs);
+    free(pf->threads);
+    free(pf);
+    return NULL;
+  }
+  pf->state = state;
+  state->pool.cow = 1;
+  pthread_mutex_init(&pf->lock, NULL);
+  pthread_cond_init(&pf->work, NULL);
+  pthread_cond_init(&pf->done, NULL);
+  for (i = 0; i < num_threads; i++) {
+    if (pthread_create(&pf->threads[i], NULL, parallel_worker, pf))
+      break;
+  }
+  pf->num_threads = i;
+  if (i < num_threads) {
+    parallel_finish(pf);
+    return NULL;
+  }
+  return pf;
+}
+
+void parallel_packet(parallel_forward *pf, uint32_t ip, unsigned int packet_id) {
+  parallel_job *job = JOB(pf, pf->tail);
+  parallel_segment *seg;
+
+  if (pf->open && job->count == PARALLEL_JOB_PACKETS)
+    parallel_close(pf);
+  if (!pf->open)
+    job = parallel_open(pf);
+
+  // a new segment if the tree changed or text came after the last packets
+  seg = job->num_segments ? &job->segments[job->num_segments - 1] : NULL;
+  if (!seg || seg->tree != pf->state->tree ||
+      seg->text_end != (job->num_segments > 1 ? seg[-1].text_end : 0)) {
+    if (job->num_segments == PARALLEL_SEGMENTS) {
+      parallel_close(pf);
+      job = parallel_open(pf);
+    }
+    parallel_new_segment(pf, job);
+    seg = &job->segments[job->num_segments - 1];
+  }
+  job->ips[job->count] = ip;
+  job->ids[job->count++] = packet_id;
+  seg->end = job->count;
+}
+
+/* Queues output to be written after that of the packets seen so far
+ * (len must not be over PARALLEL_TEXT_MAX).
+ */
+void parallel_write(parallel_forward *pf, const char *data, size_t len) {
+  parallel_job *job = JOB(pf, pf->tail);
+  parallel_segment *seg;
+
+  if (pf->open && job->segments[job->num_segments - 1].text_end + len > PARALLEL_TEXT_MAX)
+    parallel_close(pf);
+  if (!pf->open) {
+    job = parallel_open(pf);
+    parallel_new_segment(pf, job);
+  }
+  seg = &job->segments[job->num_segments - 1];
+  memcpy(job->text + seg->text_end, data, len);
+  seg->text_end += len;
+}
+
+/* Must be called before every change to the tree: packets seen so far
+ * keep the tree as it is now, and the nodes the change replaces are
+ * retired in a new epoch.
+ */
+void parallel_barrier(parallel_forward *pf) {
+  pf->state->pool.epoch++;
+}
+
+/* Waits for every job and writes out their output, so that output
+ * written straight to out_stdout comes after that of the packets seen
+ * so far.
+ */
+void parallel_sync(parallel_forward *pf) {
+  parallel_close(pf);
+  while (pf->head < pf->tail)
+    parallel_drain(pf, 1);
+}
+
+/* Waits for every job, writes out the rest of the output, and stops
+ * the workers. The tree goes back to changing in place.
+ */
+void parallel_finish(parallel_forward *pf) {
+  int i;
+
+  parallel_sync(pf);
+  pthread_mutex_lock(&pf->lock);
+  pf->stop = 1;
+  pthread_cond_broadcast(&pf->work);
+  pthread_mutex_unlock(&pf->lock);
+  for (i = 0; i < pf->num_threads; i++)
+    pthread_join(pf->threads[i], NULL);
+
+  radix_reclaim(&pf->state->pool, pf->state->pool.epoch);
+  pf->state->pool.cow = 0;
+  pthread_mutex_destroy(&pf->lock);
+  pthread_cond_destroy(&pf->work);
+  pthread_cond_destroy(&pf->done);
+  free(pf->jobs);
+  free(pf->threads);
+  free(pf);
+}
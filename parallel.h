@@ -0,0 +1,86 @@
+/*
+ *  parallel.h
+ *  Author:
+ */
+
+#ifndef _PARALLEL_H_
+#define _PARALLEL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "ip_forward.h"
+
+/* Packets per job, segments per job, and jobs in flight at most. */
+#define PARALLEL_JOB_PACKETS 512
+#define PARALLEL_SEGMENTS 64
+#define PARALLEL_JOBS 64
+
+/* Room for the output passed through as it is (advertisements) in a
+ * job, and for all of the output of a job.
+ */
+#define PARALLEL_TEXT_MAX 8192
+#define PARALLEL_OUT_MAX (PARALLEL_JOB_PACKETS * 32 + PARALLEL_TEXT_MAX)
+
+/* Packets looked up in the same tree, and the text that follows them:
+ * packets and text from where the previous segment ends up to end and
+ * text_end.
+ */
+typedef struct parallel_segment {
+  uint32_t tree;
+  int end;
+  size_t text_end;
+} parallel_segment;
+
+/* A stretch of the input for a worker: its packets, looked up in the
+ * tree of the segment each belongs to, and the output in between.
+ * epoch is that of the first segment, the oldest.
+ */
+typedef struct parallel_job {
+  uint32_t epoch;
+  int count, num_segments;
+  parallel_segment segments[PARALLEL_SEGMENTS];
+  uint32_t ips[PARALLEL_JOB_PACKETS];
+  unsigned int ids[PARALLEL_JOB_PACKETS];
+  char text[PARALLEL_TEXT_MAX];
+  radix_counters counters;   // of the job's lookups, added to the pool's when written out
+  size_t out_len;
+  char out[PARALLEL_OUT_MAX];
+  int done;
+} parallel_job;
+
+/* Parallel lookups for ip_forward. The thread that reads the input is
+ * the only one that changes the tree; it groups packets into jobs
+ * that worker threads look up and format, and writes the output of
+ * finished jobs in input order. The tree is in copy-on-write mode, so
+ * workers read it without locks while it changes: each packet is
+ * looked up from the root the tree had when the packet was read, so
+ * it sees the table as of its place in the input. Nodes replaced by
+ * an update are reclaimed once every job that started before it has
+ * been written out.
+ *
+ * Only the radix engine is supported, without the flow cache.
+ */
+typedef struct parallel_forward {
+  router_state state;
+  int num_threads;
+  pthread_t *threads;
+  parallel_job *jobs;     // ring of PARALLEL_JOBS
+  uint64_t head;          // oldest job not written out yet
+  uint64_t next;          // next job for a worker
+  uint64_t tail;          // job being filled (published jobs are before it)
+  int open;               // whether the job at tail has been started
+  int stop;
+  pthread_mutex_t lock;
+  pthread_cond_t work, done;
+} parallel_forward;
+
+parallel_forward* parallel_start(router_state state, int num_threads);
+void parallel_packet(parallel_forward *pf, uint32_t ip, unsigned int packet_id);
+void parallel_write(parallel_forward *pf, const char *data, size_t len);
+void parallel_barrier(parallel_forward *pf);
+void parallel_sync(parallel_forward *pf);
+void parallel_finish(parallel_forward *pf);
+
+#endif
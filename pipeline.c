@@ -0,0 +1,328 @@
+/*
+ * pipeline.c
+ * Author:
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <sched.h>
+#include <time.h>
+
+#include "pipeline.h"
+#include "output.h"
+
+/* Waits for the other end of a ring: spins for a while, then gives up
+ * the CPU, then sleeps, so that a stage left idle (e.g. waiting on a
+ * slow pipe) does not keep a core busy.
+ */
+static void pipeline_wait(unsigned *spins) {
+  struct timespec ts = { 0, 50000 };
+
+  if (++*spins < 128) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+  } else if (*spins < 1024) {
+    sched_yield();
+  } else {
+    nanosleep(&ts, NULL);
+  }
+}
+
+static void ring_push(pipeline_ring *ring, pipeline_batch *batch) {
+  unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  unsigned spins = 0;
+
+  while (tail - atomic_load_explicit(&ring->head, memory_order_acquire) == PIPELINE_BATCHES)
+    pipeline_wait(&spins);
+  ring->slots[tail % PIPELINE_BATCHES] = batch;
+  atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+static pipeline_batch* ring_pop(pipeline_ring *ring) {
+  unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  unsigned spins = 0;
+  pipeline_batch *batch;
+
+  while (head == atomic_load_explicit(&ring->tail, memory_order_acquire))
+    pipeline_wait(&spins);
+  batch = ring->slots[head % PIPELINE_BATCHES];
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+  return batch;
+}
+
+// An empty batch for the reader, once the writer is done with one
+static pipeline_batch* pipeline_fresh(pipeline *pl) {
+  pipeline_batch *batch = ring_pop(&pl->free);
+
+  batch->count = 0;
+  batch->last = 0;
+  batch->text_len = 0;
+  return batch;
+}
+
+/* Adds a record to the batch being filled, handing the batch to the
+ * lookup stage first if it has no room for the record and a line of
+ * text.
+ */
+static pipeline_record* pipeline_add(pipeline *pl, pipeline_batch **batch) {
+  pipeline_record *r;
+
+  if (*batch && ((*batch)->count == PIPELINE_BATCH ||
+                 (*batch)->text_len + pl->max_line > PIPELINE_TEXT_MAX)) {
+    ring_push(&pl->parsed, *batch);
+    *batch = NULL;
+  }
+  if (!*batch)
+    *batch = pipeline_fresh(pl);
+  r = &(*batch)->records[(*batch)->count++];
+  r->error = NULL;
+  r->dump_tree = 0;
+  r->len = 0;
+  return r;
+}
+
+static void pipeline_keep_text(pipeline_batch *batch, pipeline_record *r, const char *text, size_t len) {
+  r->text = batch->text_len;
+  r->len = len;
+  memcpy(batch->text + batch->text_len, text, len);
+  batch->text_len += len;
+}
+
+/* Reader for text input. Lines are classified the same way
+ * process_text in ip_forward_main.c does.
+ */
+static void pipeline_read_text(pipeline *pl, pipeline_batch **batch) {
+  const char *line;
+  size_t len;
+  unsigned int netsize, metric, update_id, packet_id;
+  uint32_t ip;
+  int nic;
+  pipeline_record *r;
+
+  while (input_next_line(pl->in, pl->max_line, &line, &len)) {
+    r = pipeline_add(pl, batch);
+    r->rec.type = toupper(line[0]);
+
+    if (r->rec.type == 'P' && scan_packet(line, len, &ip, &packet_id) == 5) {
+      r->rec.ip = ip;
+      r->rec.id = packet_id;
+    }
+    else if (r->rec.type == 'T') {
+      if (scan_table_entry(line, len, &ip, &netsize, &nic) < 6) {
+        r->error = "Invalid table entry input: %.*s";
+        pipeline_keep_text(*batch, r, line, len);
+      } else {
+        r->rec.ip = ip;
+        r->rec.netsize = netsize;
+        r->rec.nic = nic;
+      }
+    }
+    else if (r->rec.type == 'P') {
+      r->error = "Invalid packet input: %.*s";
+      pipeline_keep_text(*batch, r, line, len);
+    }
+    else if (r->rec.type == 'S') {
+    }
+    else if (r->rec.type == 'A' && !pl->binary_output) {
+      // written out exactly as it is
+      pipeline_keep_text(*batch, r, line, len);
+    }
+    else if (r->rec.type == 'A' &&
+             scan_advertisement(line, len, &ip, &netsize, &metric, &update_id) == 7) {
+      r->rec.ip = ip;
+      r->rec.netsize = netsize;
+      r->rec.metric = metric;
+      r->rec.id = update_id;
+    }
+    else {
+      r->error = "Invalid input line: %.*s\n";
+      pipeline_keep_text(*batch, r, line, len);
+      if (!pl->binary_output) {
+        // the tree goes out after everything before it, so end the batch here
+        r->dump_tree = 1;
+        ring_push(&pl->parsed, *batch);
+        *batch = NULL;
+      }
+    }
+  }
+}
+
+static void pipeline_read_binary(pipeline *pl, pipeline_batch **batch) {
+  pipeline_record *r;
+  int rc;
+
+  for (;;) {
+    r = pipeline_add(pl, batch);
+    if ((rc = input_next_record(pl->in, &r->rec)) <= 0)
+      break;
+    if (r->rec.type != 'T' && r->rec.type != 'P' && r->rec.type != 'S' && r->rec.type != 'A') {
+      r->error = "Invalid input record: %.*s\n";
+      pipeline_keep_text(*batch, r, (const char*) &r->rec.type, 1);
+    }
+  }
+  r->rec.type = 0;
+  if (rc == -1)
+    r->error = "Truncated binary trace\n";
+  else if (rc < 0)
+    r->error = "Invalid record in binary trace\n";
+  else
+    (*batch)->count--;
+}
+
+static void* pipeline_reader(void *arg) {
+  pipeline *pl = (pipeline*) arg;
+  pipeline_batch *batch = NULL;
+
+  if (pl->binary_input)
+    pipeline_read_binary(pl, &batch);
+  else
+    pipeline_read_text(pl, &batch);
+  if (!batch)
+    batch = pipeline_fresh(pl);
+  batch->last = 1;
+  ring_push(&pl->parsed, batch);
+  return NULL;
+}
+
+// Format the output of a batch whose packets have been looked up
+static void pipeline_write_batch(pipeline *pl, const pipeline_batch *batch) {
+  const pipeline_record *r;
+  trace_record rec;
+  char *p;
+  int i;
+
+  memset(&rec, 0, sizeof(rec));
+  rec.type = 'O';
+  for (i = 0; i < batch->count; i++) {
+    r = &batch->records[i];
+    if (r->error)
+      continue;
+    if (r->rec.type == 'P') {
+      p = output_reserve(&out_stdout, OUTPUT_RECORD_MAX);
+      if (pl->binary_output) {
+        rec.id = r->rec.id;
+        rec.nic = r->rec.nic;
+        p = trace_encode(p, &rec);
+      } else {
+        *p++ = 'O';
+        *p++ = ' ';
+        p = format_uint(p, r->rec.id);
+        *p++ = ' ';
+        p = format_int(p, r->rec.nic);
+        *p++ = '\n';
+      }
+      output_commit(&out_stdout, p);
+    }
+    else if (r->rec.type == 'A' && r->len) {
+      output_write(&out_stdout, batch->text + r->text, r->len);
+    }
+    else if (r->rec.type == 'A') {
+      p = output_reserve(&out_stdout, OUTPUT_RECORD_MAX);
+      if (pl->binary_output)
+        p = trace_encode(p, &r->rec);
+      else
+        p = format_trace_record(p, &r->rec);
+      output_commit(&out_stdout, p);
+    }
+  }
+}
+
+static void* pipeline_writer(void *arg) {
+  pipeline *pl = (pipeline*) arg;
+  pipeline_batch *batch;
+  int last;
+
+  do {
+    batch = ring_pop(&pl->found);
+    pipeline_write_batch(pl, batch);
+    last = batch->last;
+    ring_push(&pl->free, batch);
+    atomic_fetch_add_explicit(&pl->written, 1, memory_order_release);
+  } while (!last);
+  return NULL;
+}
+
+/* Starts the reader on in (past the trace header, for a binary trace)
+ * and the writer on out_stdout. Neither may be used by anything else
+ * until pipeline_finish. Returns NULL if the threads could not be
+ * started.
+ */
+pipeline* pipeline_start(input *in, size_t max_line, int binary_input, int binary_output) {
+  pipeline_batch *batch;
+  pipeline *pl;
+  int i;
+
+  pl = (pipeline*) aligned_alloc(64, sizeof(pipeline));
+  if (!pl)
+    return NULL;
+  memset(pl, 0, sizeof(pipeline));
+  pl->batches = (pipeline_batch*) malloc(PIPELINE_BATCHES * sizeof(pipeline_batch));
+  if (!pl->batches) {
+    free(pl);
+    return NULL;
+  }
+  pl->in = in;
+  pl->max_line = max_line;
+  pl->binary_input = binary_input;
+  pl->binary_output = binary_output;
+  atomic_init(&pl->written, 0);
+  for (i = 0; i < PIPELINE_BATCHES; i++)
+    ring_push(&pl->free, &pl->batches[i]);
+
+  if (pthread_create(&pl->writer, NULL, pipeline_writer, pl))
+    goto fail;
+  if (pthread_create(&pl->reader, NULL, pipeline_reader, pl)) {
+    // let the writer finish on an empty last batch
+    batch = pipeline_fresh(pl);
+    batch->last = 1;
+    ring_push(&pl->found, batch);
+    pthread_join(pl->writer, NULL);
+    goto fail;
+  }
+  return pl;
+
+ fail:
+  free(pl->batches);
+  free(pl);
+  return NULL;
+}
+
+/* Lookup stage: the next batch of records, in input order, or NULL
+ * once the input has ended. Each batch must go on to pipeline_pass.
+ */
+pipeline_batch* pipeline_next(pipeline *pl) {
+  pipeline_batch *batch;
+
+  if (pl->done)
+    return NULL;
+  batch = ring_pop(&pl->parsed);
+  pl->done = batch->last;
+  return batch;
+}
+
+// Hand a batch, its packets looked up, to the writer
+void pipeline_pass(pipeline *pl, pipeline_batch *batch) {
+  ring_push(&pl->found, batch);
+  pl->passed++;
+}
+
+/* Waits until every batch passed so far has been written, after which
+ * the caller may write to out_stdout until the next pipeline_pass.
+ */
+void pipeline_sync(pipeline *pl) {
+  unsigned spins = 0;
+
+  while (atomic_load_explicit(&pl->written, memory_order_acquire) != pl->passed)
+    pipeline_wait(&spins);
+}
+
+// Waits for the rest of the output and stops the threads
+void pipeline_finish(pipeline *pl) {
+  pthread_join(pl->reader, NULL);
+  pthread_join(pl->writer, NULL);
+  free(pl->batches);
+  free(pl);
+}
@@ -0,0 +1,77 @@
+/*
+ *  pipeline.h
+ *  Author:
+ */
+
+#ifndef _PIPELINE_H_
+#define _PIPELINE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "input.h"
+#include "trace.h"
+
+/* Records per batch, and room for the text kept with them. */
+#define PIPELINE_BATCH 1024
+#define PIPELINE_TEXT_MAX (1 << 16)
+
+/* Batches in flight between the stages at most (a power of two). */
+#define PIPELINE_BATCHES 8
+
+/* A record of the input, decoded by the reader. A line that can't be
+ * decoded (or an advertisement written out as it is) keeps its text.
+ */
+typedef struct pipeline_record {
+  trace_record rec;     // the NIC of a packet is filled in by the lookup stage
+  const char *error;    // for an invalid record, the message to print with its text
+  uint8_t dump_tree;    // print the tree after the error message
+  uint32_t text, len;   // text of the record in the batch, if kept
+} pipeline_record;
+
+typedef struct pipeline_batch {
+  int count;
+  int last;             // the input ends after this batch
+  size_t text_len;
+  pipeline_record records[PIPELINE_BATCH];
+  char text[PIPELINE_TEXT_MAX];
+} pipeline_batch;
+
+/* Single-producer single-consumer ring of batches. Each index is only
+ * written by one side, on its own cache line.
+ */
+typedef struct pipeline_ring {
+  _Alignas(64) atomic_uint head;   // next batch to take
+  _Alignas(64) atomic_uint tail;   // next free slot
+  pipeline_batch *slots[PIPELINE_BATCHES];
+} pipeline_ring;
+
+/* Pipelined processing for ip_forward, in three stages on their own
+ * threads: a reader that decodes the input into batches of records, a
+ * lookup stage that applies them to the table in input order (the
+ * thread that calls pipeline_next), and a writer that formats and
+ * writes out the result. Batches go from stage to stage through
+ * lock-free rings, and come back to the reader once written, so at
+ * most PIPELINE_BATCHES are ever in flight.
+ */
+typedef struct pipeline {
+  input *in;
+  size_t max_line;
+  int binary_input, binary_output;
+  pipeline_batch *batches;
+  pipeline_ring free, parsed, found;
+  atomic_ullong written;   // batches written out so far
+  unsigned long long passed;
+  int done;
+  pthread_t reader, writer;
+} pipeline;
+
+pipeline* pipeline_start(input *in, size_t max_line, int binary_input, int binary_output);
+pipeline_batch* pipeline_next(pipeline *pl);
+void pipeline_pass(pipeline *pl, pipeline_batch *batch);
+void pipeline_sync(pipeline *pl);
+void pipeline_finish(pipeline *pl);
+
+#endif
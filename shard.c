@@ -0,0 +1,334 @@
+/*
+ * shard.c
+ * Author:
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shard.h"
+#include "output.h"
+
+#define JOB(sr, i) (&(sr)->jobs[(i) % SHARD_JOBS])
+
+/* Shard of a subnet. The map hashes the same key with another
+ * multiplier, so the subnets of a shard still spread over all of its
+ * slots.
+ */
+static inline uint16_t shard_of(const shard_router *sr, uint32_t ip, uint8_t netsize) {
+  uint64_t key = (uint64_t) ip << 8 | netsize;
+
+  return ((key * 0xC2B2AE3D27D4EB4FULL) >> 32) % sr->num_shards;
+}
+
+// Advertiser of a shard's router: keep the new route for the output
+static void shard_advertise(void *arg, uint32_t ip, uint8_t netsize, int nic,
+                            unsigned int metric, unsigned int update_id) {
+  shard *sh = (shard*) arg;
+  shard_result *res = &sh->job->results[sh->pos++];
+
+  res->record = sh->record;
+  res->nic = nic;
+  res->metric = metric;
+}
+
+// Process the updates of a job that belong to the shard
+static void shard_run(shard *sh, shard_job *job) {
+  const shard_record *r;
+  int i;
+
+  sh->job = job;
+  sh->pos = job->start[sh->index];
+  for (i = job->first[sh->index]; i != -1; i = r->next) {
+    r = &job->records[i];
+    sh->record = i;
+    process_update(&sh->state, r->ip, r->netsize, r->nic, r->metric, r->update_id);
+  }
+  job->end[sh->index] = sh->pos;
+}
+
+static void* shard_worker(void *arg) {
+  shard *sh = (shard*) arg;
+  shard_router *sr = sh->sr;
+  shard_job *job;
+  uint64_t next;
+
+  pthread_mutex_lock(&sr->lock);
+  for (next = 0;; next++) {
+    while (next == sr->tail && !sr->stop)
+      pthread_cond_wait(&sr->work, &sr->lock);
+    if (next == sr->tail)
+      break;
+    job = JOB(sr, next);
+    pthread_mutex_unlock(&sr->lock);
+
+    shard_run(sh, job);
+
+    pthread_mutex_lock(&sr->lock);
+    if (--job->pending == 0)
+      pthread_cond_signal(&sr->done);
+  }
+  pthread_mutex_unlock(&sr->lock);
+  return NULL;
+}
+
+// Write out a finished job in input order
+static void shard_output(shard_router *sr, const shard_job *job) {
+  const shard_record *r;
+  const shard_result *res;
+  uint32_t *cursor = sr->cursor;
+  int i;
+
+  memcpy(cursor, job->start, sr->num_shards * sizeof(uint32_t));
+  for (i = 0; i < job->count; i++) {
+    r = &job->records[i];
+    if (r->type == 'U') {
+      if (cursor[r->shard] == job->end[r->shard])
+        continue;
+      res = &job->results[cursor[r->shard]];
+      if (res->record == (uint32_t) i) {
+        print_advertisement(r->ip, r->netsize, res->nic, res->metric, r->update_id);
+        cursor[r->shard]++;
+      }
+    }
+    else if (r->type == 'W') {
+      output_write(&out_stdout, job->text + r->text, r->len);
+    }
+    else {
+      fprintf(stderr, r->error, (int) r->len, job->text + r->text);
+    }
+  }
+}
+
+/* Writes out the finished jobs at the head of the ring, in order. With
+ * wait set, first waits for the head job to finish.
+ */
+static void shard_drain(shard_router *sr, int wait) {
+  shard_job *job;
+
+  pthread_mutex_lock(&sr->lock);
+  if (wait)
+    while (JOB(sr, sr->head)->pending)
+      pthread_cond_wait(&sr->done, &sr->lock);
+  while (sr->head < sr->tail && !JOB(sr, sr->head)->pending) {
+    job = JOB(sr, sr->head);
+    pthread_mutex_unlock(&sr->lock);
+    shard_output(sr, job);
+    pthread_mutex_lock(&sr->lock);
+    sr->head++;
+  }
+  pthread_mutex_unlock(&sr->lock);
+}
+
+// Start filling the job at tail, making room for it first
+static shard_job* shard_open(shard_router *sr) {
+  shard_job *job;
+  int s;
+
+  if (sr->tail - sr->head == SHARD_JOBS)
+    shard_drain(sr, 1);
+  job = JOB(sr, sr->tail);
+  job->count = 0;
+  job->text_len = 0;
+  for (s = 0; s < sr->num_shards; s++) {
+    job->first[s] = sr->last[s] = -1;
+    sr->counts[s] = 0;
+  }
+  sr->open = 1;
+  return job;
+}
+
+// Hand the job being filled to the shards
+static void shard_close(shard_router *sr) {
+  shard_job *job = JOB(sr, sr->tail);
+  uint32_t start = 0;
+  int s;
+
+  if (!sr->open)
+    return;
+  for (s = 0; s < sr->num_shards; s++) {
+    job->start[s] = start;
+    start += sr->counts[s];
+  }
+  job->pending = sr->num_shards;
+  sr->open = 0;
+  pthread_mutex_lock(&sr->lock);
+  sr->tail++;
+  pthread_cond_broadcast(&sr->work);
+  pthread_mutex_unlock(&sr->lock);
+  shard_drain(sr, 0);
+}
+
+// Add a record of the given type, with len bytes of text
+static shard_record* shard_add(shard_router *sr, uint8_t type, const char *text, size_t len) {
+  shard_job *job = JOB(sr, sr->tail);
+  shard_record *r;
+
+  if (sr->open && (job->count == SHARD_JOB_RECORDS || job->text_len + len > SHARD_TEXT_MAX))
+    shard_close(sr);
+  if (!sr->open)
+    job = shard_open(sr);
+  r = &job->records[job->count++];
+  r->type = type;
+  r->text = job->text_len;
+  r->len = len;
+  if (len) {
+    memcpy(job->text + job->text_len, text, len);
+    job->text_len += len;
+  }
+  return r;
+}
+
+static void shard_free(shard_router *sr) {
+  int i;
+
+  if (sr->jobs) {
+    for (i = 0; i < SHARD_JOBS; i++) {
+      free(sr->jobs[i].first);
+      free(sr->jobs[i].start);
+      free(sr->jobs[i].end);
+    }
+  }
+  if (sr->shards) {
+    for (i = 0; i < sr->num_shards; i++) {
+      if (sr->shards[i].state) {
+        destroy_router(sr->shards[i].state);
+        free(sr->shards[i].state);
+      }
+    }
+  }
+  free(sr->jobs);
+  free(sr->shards);
+  free(sr->last);
+  free(sr->counts);
+  free(sr->cursor);
+  free(sr);
+}
+
+/* Starts num_shards routers with num_nics NICs each, and their
+ * threads. Returns NULL if they could not be started.
+ */
+shard_router* shard_start(int num_shards, int num_nics) {
+  shard_router *sr;
+  shard *sh;
+  int i;
+
+  sr = (shard_router*) calloc(1, sizeof(shard_router));
+  if (!sr)
+    return NULL;
+  sr->num_shards = num_shards;
+  sr->num_nics = num_nics;
+  sr->shards = (shard*) calloc(num_shards, sizeof(shard));
+  sr->jobs = (shard_job*) calloc(SHARD_JOBS, sizeof(shard_job));
+  sr->last = (int*) malloc(num_shards * sizeof(int));
+  sr->counts = (uint32_t*) malloc(num_shards * sizeof(uint32_t));
+  sr->cursor = (uint32_t*) malloc(num_shards * sizeof(uint32_t));
+  if (!sr->shards || !sr->jobs || !sr->last || !sr->counts || !sr->cursor) {
+    shard_free(sr);
+    return NULL;
+  }
+  for (i = 0; i < SHARD_JOBS; i++) {
+    sr->jobs[i].first = (int*) malloc(num_shards * sizeof(int));
+    sr->jobs[i].start = (uint32_t*) malloc(num_shards * sizeof(uint32_t));
+    sr->jobs[i].end = (uint32_t*) malloc(num_shards * sizeof(uint32_t));
+    if (!sr->jobs[i].first || !sr->jobs[i].start || !sr->jobs[i].end) {
+      shard_free(sr);
+      return NULL;
+    }
+  }
+  for (i = 0; i < num_shards; i++) {
+    sh = &sr->shards[i];
+    sh->sr = sr;
+    sh->index = i;
+    sh->state = initialize_router();
+    set_num_nics(sh->state, num_nics);
+    set_route_advertiser(sh->state, shard_advertise, sh);
+  }
+
+  pthread_mutex_init(&sr->lock, NULL);
+  pthread_cond_init(&sr->work, NULL);
+  pthread_cond_init(&sr->done, NULL);
+  for (i = 0; i < num_shards; i++) {
+    if (pthread_create(&sr->shards[i].thread, NULL, shard_worker, &sr->shards[i]))
+      break;
+  }
+  if (i < num_shards) {
+    pthread_mutex_lock(&sr->lock);
+    sr->stop = 1;
+    pthread_cond_broadcast(&sr->work);
+    pthread_mutex_unlock(&sr->lock);
+    while (i-- > 0)
+      pthread_join(sr->shards[i].thread, NULL);
+    shard_free(sr);
+    return NULL;
+  }
+  return sr;
+}
+
+/* Queues an update for the shard of its subnet. Returns -1, ignoring
+ * the update, if nic is not one of the router's NICs (as
+ * process_update does).
+ */
+int shard_update(shard_router *sr, uint32_t ip, uint8_t netsize, int nic,
+                 unsigned int metric, unsigned int update_id) {
+  shard_job *job;
+  shard_record *r;
+  uint16_t s;
+  int index;
+
+  if (nic < 0 || nic >= sr->num_nics)
+    return -1;
+  r = shard_add(sr, 'U', NULL, 0);
+  job = JOB(sr, sr->tail);
+  index = r - job->records;
+  s = shard_of(sr, ip, netsize);
+  r->ip = ip;
+  r->netsize = netsize;
+  r->nic = nic;
+  r->metric = metric;
+  r->update_id = update_id;
+  r->shard = s;
+  r->next = -1;
+  if (sr->last[s] == -1)
+    job->first[s] = index;
+  else
+    job->records[sr->last[s]].next = index;
+  sr->last[s] = index;
+  sr->counts[s]++;
+  return 0;
+}
+
+// Queue output to be written after the advertisements of the updates so far
+void shard_write(shard_router *sr, const char *data, size_t len) {
+  shard_add(sr, 'W', data, len);
+}
+
+/* Queues an error message, printed with fprintf(stderr, format, len,
+ * text) in input order.
+ */
+void shard_error(shard_router *sr, const char *format, const char *text, size_t len) {
+  shard_add(sr, 'E', text, len)->error = format;
+}
+
+/* Waits for every job, writes out the rest of the output, and stops
+ * the shards.
+ */
+void shard_finish(shard_router *sr) {
+  int i;
+
+  shard_close(sr);
+  while (sr->head < sr->tail)
+    shard_drain(sr, 1);
+  pthread_mutex_lock(&sr->lock);
+  sr->stop = 1;
+  pthread_cond_broadcast(&sr->work);
+  pthread_mutex_unlock(&sr->lock);
+  for (i = 0; i < sr->num_shards; i++)
+    pthread_join(sr->shards[i].thread, NULL);
+
+  pthread_mutex_destroy(&sr->lock);
+  pthread_cond_destroy(&sr->work);
+  pthread_cond_destroy(&sr->done);
+  shard_free(sr);
+}
@@ -0,0 +1,102 @@
+/*
+ *  shard.h
+ *  Author:
+ */
+
+#ifndef _SHARD_H_
+#define _SHARD_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "ip_route.h"
+
+/* Records per job, room for the text kept with them, and jobs in
+ * flight at most.
+ */
+#define SHARD_JOB_RECORDS 4096
+#define SHARD_TEXT_MAX (1 << 16)
+#define SHARD_JOBS 8
+
+/* A record of the input: an update, text written out as it is, or an
+ * error message printed with its text.
+ */
+typedef struct shard_record {
+  uint8_t type;          // 'U', 'W' (write) or 'E' (error)
+  uint8_t netsize;
+  uint16_t shard;
+  uint32_t ip;
+  int nic;
+  unsigned int metric, update_id;
+  int next;              // next update of the same shard in the job, -1 at the end
+  const char *error;
+  uint32_t text, len;
+} shard_record;
+
+/* An advertisement made by a shard: the update it was made for, and
+ * the new route.
+ */
+typedef struct shard_result {
+  uint32_t record;
+  int nic;
+  unsigned int metric;
+} shard_result;
+
+/* Each shard advertises into its own stretch of results, starting at
+ * start[shard]; a shard with n updates in the job gets n entries.
+ */
+typedef struct shard_job {
+  int count, pending;
+  size_t text_len;
+  shard_record records[SHARD_JOB_RECORDS];
+  shard_result results[SHARD_JOB_RECORDS];
+  char text[SHARD_TEXT_MAX];
+  int *first;            // first update of each shard
+  uint32_t *start, *end; // results of each shard
+} shard_job;
+
+struct shard_router;
+
+/* One shard of the routing table, owned by its worker thread. */
+typedef struct shard {
+  struct shard_router *sr;
+  int index;
+  router_state state;
+  shard_job *job;        // job being worked on
+  uint32_t record, pos;  // update being processed, and where its result goes
+  pthread_t thread;
+} shard;
+
+/* Sharded processing of the updates for ip_route. Subnets are split
+ * across num_shards routers by a hash of the address and netsize, each
+ * one worked on by its own thread; the thread that reads the input
+ * groups records into jobs and sends each update to the shard of its
+ * subnet. Updates of a subnet are processed in input order by the
+ * same shard, and updates of different subnets do not affect each
+ * other, so once every shard is done with a job its advertisements are
+ * written out in the same order as a single router would write them.
+ */
+typedef struct shard_router {
+  int num_shards, num_nics;
+  shard *shards;
+  int *last;             // last update of each shard in the job being filled
+  uint32_t *counts;      // updates of each shard in the job being filled
+  uint32_t *cursor;      // next result of each shard, while writing a job out
+  shard_job *jobs;       // ring of SHARD_JOBS
+  uint64_t head;         // oldest job not written out yet
+  uint64_t tail;         // job being filled (published jobs are before it)
+  int open;              // whether the job at tail has been started
+  int stop;
+  pthread_mutex_t lock;
+  pthread_cond_t work, done;
+} shard_router;
+
+shard_router* shard_start(int num_shards, int num_nics);
+int shard_update(shard_router *sr, uint32_t ip, uint8_t netsize, int nic,
+                 unsigned int metric, unsigned int update_id);
+void shard_write(shard_router *sr, const char *data, size_t len);
+void shard_error(shard_router *sr, const char *format, const char *text, size_t len);
+void shard_finish(shard_router *sr);
+
+#endif
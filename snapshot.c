@@ -0,0 +1,150 @@
+/*
+ * snapshot.c
+ * Author:
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "snapshot.h"
+#include "flow_cache.h"
+#include "ortc.h"
+#include "output.h"
+
+#define SLAB_BYTES (RADIX_SLAB_SIZE * sizeof(radix_node))
+
+/* Writes the snapshot to a temporary file that is then renamed over
+ * filename, so a snapshot that is currently mapped (by this process or
+ * another) is never truncated under its readers.
+ */
+int save_router_snapshot(router_state state, const char *filename) {
+  static const char zeros[4096];
+  radix_pool *pool = &state->pool;
+  snapshot_header header;
+  outbuf *out;
+  char *tmpname;
+  size_t used, pad;
+  uint32_t i;
+  int fd;
+
+  tmpname = (char*) malloc(strlen(filename) + 5);
+  out = (outbuf*) malloc(sizeof(outbuf));
+  if (!tmpname || !out) {
+    free(tmpname);
+    free(out);
+    return -1;
+  }
+  sprintf(tmpname, "%s.tmp", filename);
+  fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    free(tmpname);
+    free(out);
+    return -1;
+  }
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+  header.version = SNAPSHOT_VERSION;
+  header.node_size = sizeof(radix_node);
+  header.num_slabs = pool->num_slabs;
+  header.next = pool->next;
+  header.free_list = pool->free_list;
+  header.tree = state->tree;
+  output_init(out, fd);
+  output_write(out, (const char*) &header, sizeof(header));
+
+  // Whole slabs, so that nodes allocated after a load stay inside the
+  // mapping; the unused tail of the last one is zeroed
+  for (i = 0; i < pool->num_slabs; i++) {
+    used = SLAB_BYTES;
+    if (i == pool->num_slabs - 1 && (pool->next & (RADIX_SLAB_SIZE - 1)))
+      used = (pool->next & (RADIX_SLAB_SIZE - 1)) * sizeof(radix_node);
+    output_write(out, (const char*) pool->slabs[i], used);
+    for (pad = SLAB_BYTES - used; pad > 0; pad -= min(pad, sizeof(zeros)))
+      output_write(out, zeros, min(pad, sizeof(zeros)));
+  }
+  output_flush(out);
+  free(out);
+
+  if (close(fd) || rename(tmpname, filename)) {
+    unlink(tmpname);
+    free(tmpname);
+    return -1;
+  }
+  free(tmpname);
+  return 0;
+}
+
+/* Maps the snapshot privately and points the pool slabs into it. The
+ * router must not have any nodes yet.
+ */
+int load_router_snapshot(router_state state, const char *filename) {
+  radix_pool *pool = &state->pool;
+  snapshot_header header;
+  struct stat st;
+  char *image;
+  uint32_t i;
+  int fd;
+
+  if (pool->next != 1)
+    return -2;
+  fd = open(filename, O_RDONLY);
+  if (fd < 0)
+    return -1;
+  if (fstat(fd, &st)) {
+    close(fd);
+    return -1;
+  }
+  if ((size_t) st.st_size < sizeof(header) ||
+      pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+      memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) ||
+      header.version != SNAPSHOT_VERSION ||
+      header.node_size != sizeof(radix_node) ||
+      header.num_slabs > RADIX_MAX_SLABS ||
+      (size_t) st.st_size != sizeof(header) + (size_t) header.num_slabs * SLAB_BYTES ||
+      header.next < 1 || header.next > ((uint64_t) header.num_slabs << RADIX_SLAB_BITS) ||
+      header.tree >= header.next || header.free_list >= header.next) {
+    close(fd);
+    return -2;
+  }
+  if (header.num_slabs == 0) {
+    close(fd);
+    return 0;
+  }
+
+  image = (char*) mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (image == MAP_FAILED)
+    return -1;
+
+  for (i = 0; i < header.num_slabs; i++)
+    pool->slabs[i] = (radix_node*) (image + sizeof(header) + i * SLAB_BYTES);
+  // the walks follow children unchecked, so each must name a node in the file
+  for (i = 1; i < header.next; i++) {
+    radix_node *node = RADIX_NODE(pool, i);
+    if ((node->left != RADIX_NIL && node->left >= header.next) ||
+        (node->right != RADIX_NIL && node->right >= header.next)) {
+      memset(pool->slabs, 0, header.num_slabs * sizeof(pool->slabs[0]));
+      munmap(image, st.st_size);
+      return -2;
+    }
+  }
+  pool->num_slabs = pool->image_slabs = header.num_slabs;
+  pool->next = header.next;
+  pool->free_list = header.free_list;
+  pool->image = image;
+  pool->image_size = st.st_size;
+  state->tree = header.tree;
+  state->dirty = 1;
+  if (state->fib)
+    state->fib->stale = 1;
+  if (state->cache)
+    flow_cache_invalidate(state->cache);
+  return 0;
+}
@@ -0,0 +1,39 @@
+/*
+ *  snapshot.h
+ *  Author:
+ */
+
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+#include <stdint.h>
+
+#include "ip_forward.h"
+
+/* Snapshot of a router's tree: a 32-byte header followed by the node
+ * slabs of its pool, byte for byte. Children are pool indices, so the
+ * image does not depend on where it is loaded, and loading it is a
+ * single mmap: the slabs of the pool point straight into the mapping,
+ * and later table changes copy only the pages they touch.
+ */
+#define SNAPSHOT_MAGIC "RADIXSN1"
+#define SNAPSHOT_VERSION 1
+
+typedef struct snapshot_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t node_size;
+  uint32_t num_slabs;
+  uint32_t next;
+  uint32_t free_list;
+  uint32_t tree;
+} snapshot_header;
+
+/* Both return 0 on success, -1 with errno set on a system error and
+ * -2 if the file is not a valid snapshot (or the router already has a
+ * table, when loading).
+ */
+int save_router_snapshot(router_state state, const char *filename);
+int load_router_snapshot(router_state state, const char *filename);
+
+#endif
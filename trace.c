@@ -0,0 +1,164 @@
+/*
+ * trace.c
+ * Author:
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "trace.h"
+
+// Size of a record of the given type, 0 if the type is unknown
+int trace_record_size(uint8_t type) {
+  switch (type) {
+  case 'S':
+    return 4;
+  case 'T':
+  case 'P':
+  case 'O':
+    return 12;
+  case 'A':
+    return 16;
+  case 'U':
+    return 20;
+  default:
+    return 0;
+  }
+}
+
+static inline char* put32(char *p, uint32_t v) {
+  memcpy(p, &v, 4);
+  return p + 4;
+}
+
+static inline uint32_t get32(const char *p) {
+  uint32_t v;
+
+  memcpy(&v, p, 4);
+  return v;
+}
+
+/* Writes the record at p (at most TRACE_RECORD_MAX bytes) and returns
+ * the end.
+ */
+char* trace_encode(char *p, const trace_record *rec) {
+  p[0] = rec->type;
+  p[1] = rec->netsize;
+  p[2] = p[3] = 0;
+  p += 4;
+  switch (rec->type) {
+  case 'T':
+    p = put32(p, rec->ip);
+    p = put32(p, rec->nic);
+    break;
+  case 'P':
+    p = put32(p, rec->ip);
+    p = put32(p, rec->id);
+    break;
+  case 'U':
+    p = put32(p, rec->ip);
+    p = put32(p, rec->nic);
+    p = put32(p, rec->metric);
+    p = put32(p, rec->id);
+    break;
+  case 'A':
+    p = put32(p, rec->ip);
+    p = put32(p, rec->metric);
+    p = put32(p, rec->id);
+    break;
+  case 'O':
+    p = put32(p, rec->id);
+    p = put32(p, rec->nic);
+    break;
+  }
+  return p;
+}
+
+/* Reads a record of a known type; p must hold trace_record_size bytes. */
+void trace_decode(const char *p, trace_record *rec) {
+  memset(rec, 0, sizeof(trace_record));
+  rec->type = p[0];
+  rec->netsize = p[1];
+  p += 4;
+  switch (rec->type) {
+  case 'T':
+    rec->ip = get32(p);
+    rec->nic = get32(p + 4);
+    break;
+  case 'P':
+    rec->ip = get32(p);
+    rec->id = get32(p + 4);
+    break;
+  case 'U':
+    rec->ip = get32(p);
+    rec->nic = get32(p + 4);
+    rec->metric = get32(p + 8);
+    rec->id = get32(p + 12);
+    break;
+  case 'A':
+    rec->ip = get32(p);
+    rec->metric = get32(p + 4);
+    rec->id = get32(p + 8);
+    break;
+  case 'O':
+    rec->id = get32(p);
+    rec->nic = get32(p + 4);
+    break;
+  }
+}
+
+void trace_write_header(outbuf *out) {
+  trace_header header;
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+  header.version = TRACE_VERSION;
+  output_write(out, (const char*) &header, sizeof(header));
+}
+
+/* Formats a record as the text line it stands for, newline included,
+ * and returns the end. Needs at most OUTPUT_RECORD_MAX bytes.
+ */
+char* format_trace_record(char *p, const trace_record *rec) {
+  *p++ = rec->type;
+  if (rec->type == 'S') {
+    *p++ = '\n';
+    return p;
+  }
+  *p++ = ' ';
+  switch (rec->type) {
+  case 'T':
+  case 'U':
+  case 'A':
+    p = format_ip(p, rec->ip);
+    *p++ = '/';
+    p = format_uint(p, rec->netsize);
+    *p++ = ' ';
+    if (rec->type == 'A') {
+      p = format_uint(p, rec->metric);
+    } else {
+      p = format_int(p, rec->nic);
+    }
+    if (rec->type == 'U') {
+      *p++ = ' ';
+      p = format_uint(p, rec->metric);
+    }
+    if (rec->type != 'T') {
+      *p++ = ' ';
+      p = format_uint(p, rec->id);
+    }
+    break;
+  case 'P':
+    p = format_ip(p, rec->ip);
+    *p++ = ' ';
+    p = format_uint(p, rec->id);
+    break;
+  case 'O':
+    p = format_uint(p, rec->id);
+    *p++ = ' ';
+    p = format_int(p, rec->nic);
+    break;
+  }
+  *p++ = '\n';
+  return p;
+}
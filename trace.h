@@ -0,0 +1,61 @@
+/*
+ *  trace.h
+ *  Author:
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+
+#include "output.h"
+
+/* Binary trace format: a 16-byte header followed by tagged records in
+ * host byte order. Each record is a 4-byte head (type, netsize and
+ * padding) followed by the 32-bit fields of its type, in this order:
+ *
+ *   type  fields                          size
+ *   'T'   ip, nic                         12
+ *   'P'   ip, id (packet id)              12
+ *   'U'   ip, nic, metric, id (update id) 20
+ *   'A'   ip, metric, id (update id)      16
+ *   'O'   id (packet id), nic             12
+ *   'S'   (stats request)                 4
+ *
+ * Every record is a multiple of 4 bytes, so fields of a mapped file
+ * can be read in place.
+ */
+#define TRACE_MAGIC "IPTRACE1"
+#define TRACE_VERSION 1
+#define TRACE_RECORD_MAX 20
+
+typedef struct trace_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+} trace_header;
+
+/* A record decoded; only the fields of its type are meaningful. */
+typedef struct trace_record {
+  uint8_t type;
+  uint8_t netsize;
+  uint32_t ip;
+  int32_t nic;
+  uint32_t metric;
+  uint32_t id;
+} trace_record;
+
+int trace_record_size(uint8_t type);
+char* trace_encode(char *p, const trace_record *rec);
+void trace_decode(const char *p, trace_record *rec);
+
+void trace_write_header(outbuf *out);
+char* format_trace_record(char *p, const trace_record *rec);
+
+static inline void trace_write_record(outbuf *out, const trace_record *rec) {
+  char *p = output_reserve(out, TRACE_RECORD_MAX);
+
+  output_commit(out, trace_encode(p, rec));
+}
+
+#endif
@@ -0,0 +1,114 @@
+/*
+ *  trace_conv.c
+ *  Author:
+ *
+ *  Converts text traces (T, P, U, A and O lines) to the binary format
+ *  of trace.h, or back to text with -d.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+
+#include "input.h"
+#include "output.h"
+#include "trace.h"
+
+/* Largest line in the input file. */
+#define MAXLINE 1000
+
+static int encode(input *in) {
+  const char *line;
+  size_t len;
+  unsigned int netsize, metric, id;
+  uint32_t ip;
+  int nic, valid;
+  trace_record rec;
+
+  trace_write_header(&out_stdout);
+  memset(&rec, 0, sizeof(rec));
+
+  while (input_next_line(in, MAXLINE, &line, &len)) {
+    // fields a line leaves out are 0, not those of the line before
+    ip = netsize = metric = id = 0;
+    nic = 0;
+    rec.type = toupper(line[0]);
+    switch (rec.type) {
+    case 'T':
+      valid = scan_table_entry(line, len, &ip, &netsize, &nic) >= 6;
+      break;
+    case 'P':
+      valid = scan_packet(line, len, &ip, &id) >= 5;
+      break;
+    case 'U':
+      // like ip_route, metric and update id may be missing
+      valid = scan_update(line, len, &ip, &netsize, &nic, &metric, &id) >= 6;
+      break;
+    case 'A':
+      valid = scan_advertisement(line, len, &ip, &netsize, &metric, &id) >= 7;
+      break;
+    case 'O':
+      valid = scan_output(line, len, &id, &nic) >= 2;
+      break;
+    case 'S':
+      valid = 1;
+      break;
+    default:
+      valid = 0;
+    }
+    if (!valid) {
+      fprintf(stderr, "Invalid input line: %.*s\n", (int) len, line);
+      continue;
+    }
+    rec.netsize = netsize;
+    rec.ip = ip;
+    rec.nic = nic;
+    rec.metric = metric;
+    rec.id = id;
+    trace_write_record(&out_stdout, &rec);
+  }
+  return EXIT_SUCCESS;
+}
+
+static int decode(input *in) {
+  trace_record rec;
+  int rc;
+  char *p;
+
+  if (input_read_trace_header(in)) {
+    fprintf(stderr, "Input is not a binary trace\n");
+    return EXIT_FAILURE;
+  }
+  while ((rc = input_next_record(in, &rec)) > 0) {
+    p = output_reserve(&out_stdout, OUTPUT_RECORD_MAX);
+    output_commit(&out_stdout, format_trace_record(p, &rec));
+  }
+  if (rc < 0) {
+    fprintf(stderr, (rc == -1) ? "Truncated binary trace\n" : "Invalid record in binary trace\n");
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[]) {
+
+  input in;
+  int rc;
+
+  if (argc > 2 || (argc == 2 && strcmp(argv[1], "-d"))) {
+    fprintf(stderr, "Usage: %s [-d] < input > output\n", argv[0]);
+    return 2;
+  }
+  if (input_open(&in, STDIN_FILENO)) {
+    perror("Could not read input");
+    return 2;
+  }
+
+  rc = (argc == 2) ? decode(&in) : encode(&in);
+
+  input_close(&in);
+  output_flush(&out_stdout);
+  return rc;
+}
@@ -0,0 +1,176 @@
+/*
+ * tree_bitmap.c
+ * Author:
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tree_bitmap.h"
+
+// The TBM_STRIDE bits of key that follow the first depth bits
+static inline uint32_t tbm_chunk(uint32_t key, int depth) {
+  return ((uint64_t) key << 32 << depth) >> (64 - TBM_STRIDE);
+}
+
+// Make room for n more nodes and return the first, or -1
+static int64_t tbm_alloc_nodes(tree_bitmap *tbm, uint32_t n) {
+  tbm_node *nodes;
+
+  while (tbm->num_nodes + n > tbm->max_nodes) {
+    tbm->max_nodes = tbm->max_nodes ? tbm->max_nodes * 2 : 1024;
+    nodes = (tbm_node*) realloc(tbm->nodes, (size_t) tbm->max_nodes * sizeof(tbm_node));
+    if (!nodes) return -1;
+    tbm->nodes = nodes;
+  }
+  tbm->num_nodes += n;
+  return tbm->num_nodes - n;
+}
+
+static int64_t tbm_alloc_results(tree_bitmap *tbm, uint32_t n) {
+  int *results;
+
+  while (tbm->num_results + n > tbm->max_results) {
+    tbm->max_results = tbm->max_results ? tbm->max_results * 2 : 1024;
+    results = (int*) realloc(tbm->results, (size_t) tbm->max_results * sizeof(int));
+    if (!results) return -1;
+    tbm->results = results;
+  }
+  tbm->num_results += n;
+  return tbm->num_results - n;
+}
+
+/* Fills in node index, at the given depth, from the prefixes p[lo, hi)
+ * (all under the node's bit string, or ancestors of it that are
+ * skipped), then its children.
+ */
+static int tbm_fill(tree_bitmap *tbm, uint32_t index, const radix_prefix *p, int lo, int hi, int depth) {
+  uint32_t internal = 0, external = 0, chunk, bit, l;
+  int64_t child, result;
+  int i, j;
+
+  for (i = lo; i < hi; i++) {
+    if (p[i].bits < depth) continue;
+    chunk = tbm_chunk(p[i].key, depth);
+    l = p[i].bits - depth;
+    if (l < TBM_STRIDE)
+      internal |= 1U << ((1U << l) - 1 + (chunk >> (TBM_STRIDE - l)));
+    else
+      external |= 1U << chunk;
+  }
+
+  result = tbm_alloc_results(tbm, __builtin_popcount(internal));
+  child = tbm_alloc_nodes(tbm, __builtin_popcount(external));
+  if (result < 0 || child < 0) return -1;
+  tbm->nodes[index].internal = internal;
+  tbm->nodes[index].external = external;
+  tbm->nodes[index].child = child;
+  tbm->nodes[index].result = result;
+
+  for (i = lo; i < hi; i++) {
+    l = p[i].bits - depth;
+    if (p[i].bits < depth || l >= TBM_STRIDE) continue;
+    bit = (1U << l) - 1 + (tbm_chunk(p[i].key, depth) >> (TBM_STRIDE - l));
+    tbm->results[result + __builtin_popcount(internal & ((1U << bit) - 1))] = p[i].value;
+  }
+
+  for (i = lo; i < hi; i = j) {
+    if (p[i].bits < depth + TBM_STRIDE) {
+      j = i + 1;
+      continue;
+    }
+    chunk = tbm_chunk(p[i].key, depth);
+    for (j = i + 1; j < hi && tbm_chunk(p[j].key, depth) == chunk; j++)
+      ;
+    if (tbm_fill(tbm, child + __builtin_popcount(external & ((1U << chunk) - 1)),
+                 p, i, j, depth + TBM_STRIDE))
+      return -1;
+  }
+  return 0;
+}
+
+/* Compiles the radix tree into a Tree Bitmap. The arrays of tbm are
+ * reused if it is not NULL. Returns NULL (and frees tbm) if memory
+ * runs out; the caller should keep using the radix tree in that case.
+ */
+tree_bitmap* tree_bitmap_build(tree_bitmap *tbm, radix_pool *pool, uint32_t tree) {
+  radix_prefix *prefixes;
+  uint32_t chunk, l, count, i;
+  int rc;
+
+  if (!tbm) {
+    tbm = (tree_bitmap*) calloc(1, sizeof(tree_bitmap));
+    if (!tbm) return NULL;
+    for (chunk = 0; chunk < (1U << TBM_STRIDE); chunk++) {
+      for (l = 0; l < TBM_STRIDE; l++)
+        tbm->match[chunk] |= 1U << ((1U << l) - 1 + (chunk >> (TBM_STRIDE - l)));
+    }
+  }
+  tbm->num_nodes = tbm->num_results = 0;
+
+  prefixes = radix_prefixes(pool, tree, &count);
+  // a netsize past 32 is a host route, as the radix lookups take it
+  for (i = 0; prefixes && i < count; i++)
+    prefixes[i].bits = min(prefixes[i].bits, 32);
+  rc = !prefixes || tbm_alloc_nodes(tbm, 1) < 0 || tbm_fill(tbm, 0, prefixes, 0, count, 0);
+  free(prefixes);
+  if (rc) {
+    tree_bitmap_free(tbm);
+    return NULL;
+  }
+  return tbm;
+}
+
+/* Looks up n (at most FORWARD_BATCH) addresses a level at a time,
+ * prefetching the next node of every address before reading any, then
+ * all of the NICs.
+ */
+void tree_bitmap_lookup_batch(const tree_bitmap *tbm, const uint32_t *ips, int *nics, int n) {
+  const tbm_node *node[FORWARD_BATCH], *best[FORWARD_BATCH];
+  uint32_t best_bit[FORWARD_BATCH], chunk, match;
+  uint64_t key[FORWARD_BATCH];
+  int i, active;
+
+  for (i = 0; i < n; i++) {
+    node[i] = tbm->nodes;
+    best[i] = NULL;
+    key[i] = (uint64_t) ips[i] << 32;
+  }
+  for (active = n; active; ) {
+    active = 0;
+    for (i = 0; i < n; i++) {
+      if (!node[i]) continue;
+      chunk = key[i] >> (64 - TBM_STRIDE);
+      match = node[i]->internal & tbm->match[chunk];
+      if (match) {
+        best[i] = node[i];
+        best_bit[i] = 31 - __builtin_clz(match);
+      }
+      if (node[i]->external >> chunk & 1) {
+        node[i] = tbm->nodes + node[i]->child +
+                  __builtin_popcount(node[i]->external & ((1U << chunk) - 1));
+        __builtin_prefetch(node[i]);
+        key[i] <<= TBM_STRIDE;
+        active++;
+      } else {
+        node[i] = NULL;
+      }
+    }
+  }
+  for (i = 0; i < n; i++) {
+    if (best[i]) {
+      best_bit[i] = best[i]->result + __builtin_popcount(best[i]->internal & ((1U << best_bit[i]) - 1));
+      __builtin_prefetch(&tbm->results[best_bit[i]]);
+    }
+  }
+  for (i = 0; i < n; i++)
+    nics[i] = best[i] ? tbm->results[best_bit[i]] : -1;
+}
+
+void tree_bitmap_free(tree_bitmap *tbm) {
+  if (!tbm) return;
+  free(tbm->nodes);
+  free(tbm->results);
+  free(tbm);
+}
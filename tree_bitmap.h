@@ -0,0 +1,69 @@
+/*
+ *  tree_bitmap.h
+ *  Author:
+ */
+
+#ifndef _TREE_BITMAP_H_
+#define _TREE_BITMAP_H_
+
+#include <stdint.h>
+
+#include "ip_forward.h"
+
+/* Tree Bitmap: a multibit trie taking TBM_STRIDE bits of the address
+ * per node. A node covers the prefixes that end in its stride (lengths
+ * 0 to TBM_STRIDE - 1 past its depth) with the internal bitmap, where
+ * a prefix of length l and value v is bit (1 << l) - 1 + v, and its
+ * children with the external bitmap, one bit per value of the stride.
+ * Children of a node are contiguous in nodes, and so are the NICs of
+ * its prefixes in results; both are found by counting the bits set
+ * before the one wanted. Seven levels cover the 32 bits, /32s ending
+ * in the last one.
+ */
+#define TBM_STRIDE 5
+
+typedef struct tbm_node {
+  uint32_t internal;
+  uint32_t external;
+  uint32_t child;    // index of the first child
+  uint32_t result;   // index of the NIC of the first prefix
+} tbm_node;
+
+typedef struct tree_bitmap {
+  tbm_node *nodes;   // the root is node 0
+  int *results;
+  uint32_t num_nodes, max_nodes;
+  uint32_t num_results, max_results;
+  uint32_t match[1 << TBM_STRIDE];   // internal bits of the prefixes that match a stride value
+} tree_bitmap;
+
+tree_bitmap* tree_bitmap_build(tree_bitmap *tbm, radix_pool *pool, uint32_t tree);
+void tree_bitmap_free(tree_bitmap *tbm);
+void tree_bitmap_lookup_batch(const tree_bitmap *tbm, const uint32_t *ips, int *nics, int n);
+
+/* Returns the NIC of the longest prefix containing ip, or -1. Only the
+ * last node with a match is remembered; its NIC is read at the end.
+ */
+static inline int tree_bitmap_lookup(const tree_bitmap *tbm, uint32_t ip) {
+  const tbm_node *node = tbm->nodes, *best = NULL;
+  uint64_t key = (uint64_t) ip << 32;
+  uint32_t chunk, match, best_bit = 0;
+
+  for (;;) {
+    chunk = key >> (64 - TBM_STRIDE);
+    match = node->internal & tbm->match[chunk];
+    if (match) {
+      best = node;
+      best_bit = 31 - __builtin_clz(match);
+    }
+    if (!(node->external >> chunk & 1))
+      break;
+    node = tbm->nodes + node->child + __builtin_popcount(node->external & ((1U << chunk) - 1));
+    key <<= TBM_STRIDE;
+  }
+  if (!best)
+    return -1;
+  return tbm->results[best->result + __builtin_popcount(best->internal & ((1U << best_bit) - 1))];
+}
+
+#endif
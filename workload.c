@@ -0,0 +1,189 @@
+/*
+ * workload.c
+ * Author:
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "workload.h"
+
+void workload_seed(workload_rng *rng, uint64_t seed) {
+  rng->state = seed;
+}
+
+// splitmix64
+uint64_t workload_next(workload_rng *rng) {
+  uint64_t z = (rng->state += 0x9E3779B97F4A7C15ULL);
+
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+static inline double workload_unit(workload_rng *rng) {
+  return (workload_next(rng) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static inline uint32_t prefix_mask(uint8_t netsize) {
+  return netsize ? 0xFFFFFFFFU << (32 - netsize) : 0;
+}
+
+/* Share of each prefix length in a BGP table, per ten thousand, /8 to
+ * /32. Roughly 58% are /24; the long ones stand for the customer
+ * routes of an internal table.
+ */
+static const uint16_t bgp_lengths[25] = {
+  1, 1, 2, 5, 10, 20, 40, 70, 130, 80, 140, 250, 400, 450, 900, 800,
+  5800, 100, 100, 80, 80, 100, 150, 20, 250
+};
+
+static uint8_t bgp_length(workload_rng *rng) {
+  uint32_t total = 0, r;
+  int i;
+
+  for (i = 0; i < 25; i++)
+    total += bgp_lengths[i];
+  r = workload_below(rng, total);
+  for (i = 0; r >= bgp_lengths[i]; i++)
+    r -= bgp_lengths[i];
+  return 8 + i;
+}
+
+/* Set of the prefixes generated so far, open addressing on the prefix. */
+typedef struct prefix_set {
+  uint64_t *slots;
+  size_t mask;
+} prefix_set;
+
+static int prefix_set_add(prefix_set *set, uint32_t ip, uint8_t netsize) {
+  uint64_t key = ((uint64_t) ip << 8 | netsize) + 1;
+  size_t i = (key * 0x9E3779B97F4A7C15ULL) >> 20 & set->mask;
+
+  while (set->slots[i]) {
+    if (set->slots[i] == key) return 0;
+    i = (i + 1) & set->mask;
+  }
+  set->slots[i] = key;
+  return 1;
+}
+
+void workload_prefixes(workload_rng *rng, workload_lengths lengths, workload_prefix *prefixes, size_t n) {
+  prefix_set set;
+  size_t i, size;
+  uint32_t ip;
+  uint8_t netsize;
+  const workload_prefix *outer;
+
+  for (size = 1024; size < 2 * n; size *= 2);
+  set.slots = (uint64_t*) calloc(size, sizeof(uint64_t));
+  if (!set.slots) {
+    perror("Could not allocate workload");
+    exit(EXIT_FAILURE);
+  }
+  set.mask = size - 1;
+
+  for (i = 0; i < n; ) {
+    if (lengths == LENGTHS_UNIFORM) {
+      netsize = workload_below(rng, 31) + 1;
+      ip = (uint32_t) workload_next(rng);
+    } else {
+      netsize = bgp_length(rng);
+      outer = i ? &prefixes[workload_below(rng, i)] : NULL;
+      // more specifics of an earlier route, as aggregates are split
+      if (outer && outer->netsize < netsize && workload_below(rng, 10) < 3)
+        ip = outer->ip | ((uint32_t) workload_next(rng) & ~prefix_mask(outer->netsize));
+      else
+        ip = (workload_below(rng, 223) + 1) << 24 | ((uint32_t) workload_next(rng) & 0xFFFFFF);
+    }
+    ip &= prefix_mask(netsize);
+    if (!prefix_set_add(&set, ip, netsize))
+      continue;
+    prefixes[i].ip = ip;
+    prefixes[i++].netsize = netsize;
+  }
+  free(set.slots);
+}
+
+// A random address inside a random prefix of the table
+uint32_t workload_destination(workload_rng *rng, const workload_prefix *prefixes, size_t n) {
+  const workload_prefix *prefix = &prefixes[workload_below(rng, n)];
+
+  return prefix->ip | ((uint32_t) workload_next(rng) & ~prefix_mask(prefix->netsize));
+}
+
+// Returns -1 if out of memory
+int workload_zipf_init(workload_zipf *zipf, uint32_t n, double s) {
+  double sum = 0;
+  uint32_t i;
+
+  zipf->cdf = (double*) malloc(n * sizeof(double));
+  if (!zipf->cdf)
+    return -1;
+  zipf->n = n;
+  for (i = 0; i < n; i++) {
+    sum += 1.0 / pow(i + 1, s);
+    zipf->cdf[i] = sum;
+  }
+  for (i = 0; i < n; i++)
+    zipf->cdf[i] /= sum;
+  return 0;
+}
+
+// A rank in [0, n)
+uint32_t workload_zipf_next(const workload_zipf *zipf, workload_rng *rng) {
+  double u = workload_unit(rng);
+  uint32_t lo = 0, hi = zipf->n - 1, mid;
+
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (zipf->cdf[mid] < u)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+void workload_zipf_free(workload_zipf *zipf) {
+  free(zipf->cdf);
+  zipf->cdf = NULL;
+}
+
+uint64_t workload_now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int double_cmp(const void *a, const void *b) {
+  double x = *(const double*) a, y = *(const double*) b;
+
+  return (x > y) - (x < y);
+}
+
+void workload_sort(double *samples, size_t n) {
+  qsort(samples, n, sizeof(double), double_cmp);
+}
+
+// Nearest-rank percentile, p in [0, 100]
+double workload_percentile(const double *samples, size_t n, double p) {
+  size_t rank;
+
+  if (!n) return 0;
+  rank = (size_t) ceil(p / 100 * n);
+  return samples[rank ? rank - 1 : 0];
+}
+
+// Peak resident set of this process so far
+long workload_peak_rss_kb(void) {
+  struct rusage usage;
+
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
@@ -0,0 +1,68 @@
+/*
+ *  workload.h
+ *  Author:
+ */
+
+#ifndef _WORKLOAD_H_
+#define _WORKLOAD_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Seeded workload generation shared by gen_cidr and the benchmarks.
+ * The same seed always gives the same tables, packets and updates.
+ */
+
+typedef struct workload_rng {
+  uint64_t state;
+} workload_rng;
+
+void workload_seed(workload_rng *rng, uint64_t seed);
+uint64_t workload_next(workload_rng *rng);
+
+// Uniform in [0, n)
+static inline uint32_t workload_below(workload_rng *rng, uint32_t n) {
+  return (uint32_t) (((workload_next(rng) >> 32) * n) >> 32);
+}
+
+/* Prefix length distributions: uniform over /1../31 (the original
+ * gen_cidr), or shaped like a BGP table, with most prefixes /24 and a
+ * fraction nested inside earlier, shorter ones.
+ */
+typedef enum workload_lengths {
+  LENGTHS_UNIFORM,
+  LENGTHS_BGP
+} workload_lengths;
+
+typedef struct workload_prefix {
+  uint32_t ip;
+  uint8_t netsize;
+} workload_prefix;
+
+/* Fills prefixes with n distinct prefixes without host bits. */
+void workload_prefixes(workload_rng *rng, workload_lengths lengths, workload_prefix *prefixes, size_t n);
+
+/* Packet destinations are drawn uniformly from the space routed by the
+ * table. Skewed workloads pick among n items (hot destinations,
+ * prefixes) by rank, rank i with probability proportional to
+ * 1 / (i + 1)^s.
+ */
+typedef struct workload_zipf {
+  double *cdf;
+  uint32_t n;
+} workload_zipf;
+
+uint32_t workload_destination(workload_rng *rng, const workload_prefix *prefixes, size_t n);
+int workload_zipf_init(workload_zipf *zipf, uint32_t n, double s);
+uint32_t workload_zipf_next(const workload_zipf *zipf, workload_rng *rng);
+void workload_zipf_free(workload_zipf *zipf);
+
+/* Timing helpers for the benchmark harnesses. workload_percentile
+ * expects samples sorted with workload_sort.
+ */
+uint64_t workload_now_ns(void);
+void workload_sort(double *samples, size_t n);
+double workload_percentile(const double *samples, size_t n, double p);
+long workload_peak_rss_kb(void);
+
+#endif